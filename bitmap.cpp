@@ -0,0 +1,324 @@
+#include "corpus.h"
+#include <algorithm>
+
+void build_bitmaps(Index &index, const Column &column)
+{
+	size_t size = column.size();
+	size_t values = index.offsets.empty() ? 0 : index.offsets.size() - 1;
+	std::vector<uint32_t> slots(values, NO_ID);
+	uint32_t count = 0;
+	for (size_t value = 0; value < values; value++)
+	{
+		size_t frequency = index.count(value);
+		if (frequency > 0 && frequency * BITMAP_DENSITY >= size)
+		{
+			slots[value] = count++;
+		}
+	}
+	if (count == 0)
+	{
+		return;
+	}
+
+	size_t words = bitmap_words(size);
+	std::vector<uint64_t> bitmaps(count * words, 0);
+	std::visit([&](const auto &array)
+			   {
+		for (size_t pos = 0; pos < size; pos++)
+		{
+			uint32_t slot = slots[array[pos]];
+			if (slot != NO_ID)
+			{
+				bitmaps[slot * words + pos / 64] |= uint64_t(1) << (pos % 64);
+			}
+		} }, column.values);
+	index.bitmap_slots = std::move(slots);
+	index.bitmaps = std::move(bitmaps);
+}
+
+std::optional<BitmapSet> bitmap_lookup(const Corpus &corpus, Attribute attribute, uint32_t value)
+{
+	const Index *index = find_index(corpus, attribute);
+	if (value >= index->bitmap_slots.size() || index->bitmap_slots[value] == NO_ID)
+	{
+		// also covers NO_ID
+		return std::nullopt;
+	}
+	size_t words = bitmap_words(corpus.size());
+	std::span<const uint64_t> bitmap = index->bitmaps.span().subspan(index->bitmap_slots[value] * words, words);
+	// a view, the corpus outlives its query results
+	return BitmapSet{Array<uint64_t>(bitmap, nullptr), 0, index->count(value)};
+}
+
+bool test_bit(const BitmapSet &set, int pos)
+{
+	int64_t bit = static_cast<int64_t>(pos) - set.shift;
+	if (bit < 0 || bit >= static_cast<int64_t>(set.words.size() * 64))
+	{
+		return false;
+	}
+	return (set.words[bit / 64] >> (bit % 64)) & 1;
+}
+
+uint64_t bitmap_word(const BitmapSet &set, int64_t first)
+{
+	int64_t bit = first - set.shift;
+	int64_t word = bit >> 6;
+	int offset = bit & 63;
+	int64_t count = set.words.size();
+	uint64_t low = word >= 0 && word < count ? set.words[word] : 0;
+	if (offset == 0)
+	{
+		return low;
+	}
+	uint64_t high = word + 1 >= 0 && word + 1 < count ? set.words[word + 1] : 0;
+	return low >> offset | high << (64 - offset);
+}
+
+uint64_t low_bits(int64_t count)
+{
+	if (count <= 0)
+	{
+		return 0;
+	}
+	return count >= 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+}
+
+// the bits of positions [first, first + 64) that are in a dense set
+uint64_t dense_word(const DenseSet &set, int64_t first)
+{
+	return low_bits(set.last - first) & ~low_bits(set.first - first);
+}
+
+// a bitmap of the positions [shift, shift + bits), word(p) gives the bits
+// of positions [p, p + 64)
+template <typename F>
+BitmapSet make_bitmap(int shift, size_t bits, F &&word)
+{
+	std::vector<uint64_t> words(bitmap_words(bits));
+	size_t size = 0;
+	for (size_t w = 0; w < words.size(); w++)
+	{
+		uint64_t value = word(static_cast<int64_t>(shift) + static_cast<int64_t>(64 * w));
+		if (w + 1 == words.size())
+		{
+			value &= low_bits(bits - 64 * w);
+		}
+		words[w] = value;
+		size += std::popcount(value);
+	}
+	return BitmapSet{Array<uint64_t>(std::move(words)), shift, size};
+}
+
+size_t bitmap_bits(const BitmapSet &set)
+{
+	return set.words.size() * 64;
+}
+
+BitmapSet intersection(const BitmapSet &A, const BitmapSet &B)
+{
+	if (A.shift == B.shift && A.words.size() == B.words.size())
+	{
+		// aligned: plain word-wise AND
+		return make_bitmap(A.shift, bitmap_bits(A), [&](int64_t first)
+						   {
+			size_t w = (first - A.shift) / 64;
+			return A.words[w] & B.words[w]; });
+	}
+	return make_bitmap(A.shift, bitmap_bits(A), [&](int64_t first)
+					   { return bitmap_word(A, first) & bitmap_word(B, first); });
+}
+
+BitmapSet intersection(const BitmapSet &A, const DenseSet &B)
+{
+	return make_bitmap(A.shift, bitmap_bits(A), [&](int64_t first)
+					   { return bitmap_word(A, first) & dense_word(B, first); });
+}
+
+BitmapSet intersection(const DenseSet &A, const BitmapSet &B)
+{
+	return intersection(B, A);
+}
+
+BitmapSet difference(const BitmapSet &A, const BitmapSet &B)
+{
+	if (A.shift == B.shift && A.words.size() == B.words.size())
+	{
+		return make_bitmap(A.shift, bitmap_bits(A), [&](int64_t first)
+						   {
+			size_t w = (first - A.shift) / 64;
+			return A.words[w] & ~B.words[w]; });
+	}
+	return make_bitmap(A.shift, bitmap_bits(A), [&](int64_t first)
+					   { return bitmap_word(A, first) & ~bitmap_word(B, first); });
+}
+
+BitmapSet difference(const BitmapSet &A, const DenseSet &B)
+{
+	return make_bitmap(A.shift, bitmap_bits(A), [&](int64_t first)
+					   { return bitmap_word(A, first) & ~dense_word(B, first); });
+}
+
+BitmapSet difference(const DenseSet &A, const BitmapSet &B)
+{
+	// the complement of a bitmap within the dense range
+	size_t bits = A.last > A.first ? A.last - A.first : 0;
+	return make_bitmap(A.first, bits, [&](int64_t first)
+					   { return ~bitmap_word(B, first); });
+}
+
+// the positions of a list that are (or are not) in a bitmap
+template <typename S>
+ExplicitSet filter_list(const S &list, const BitmapSet &bitmap, bool keep)
+{
+	size_t size;
+	if constexpr (std::is_same_v<S, CompressedSet>)
+	{
+		size = list.size;
+	}
+	else
+	{
+		size = list.elems.size();
+	}
+	ExplicitSet result = scratch_set(size);
+	for_each_position(list, [&](int pos)
+					  {
+		if (test_bit(bitmap, pos) == keep)
+		{
+			result.elems.push_back(pos);
+		} });
+	return result;
+}
+
+// a bitmap of the positions in either set, covering the positions of both
+BitmapSet bitmap_union(const MatchSet &A, const MatchSet &B)
+{
+	// the frame spans the bitmaps and the listed positions
+	std::vector<int> listed;
+	int64_t first = std::numeric_limits<int64_t>::max();
+	int64_t last = std::numeric_limits<int64_t>::min();
+	for (const MatchSet *set : {&A, &B})
+	{
+		if (const BitmapSet *bitmap = std::get_if<BitmapSet>(&set->set))
+		{
+			first = std::min<int64_t>(first, bitmap->shift);
+			last = std::max<int64_t>(last, bitmap->shift + static_cast<int64_t>(bitmap_bits(*bitmap)));
+		}
+		else
+		{
+			size_t from = listed.size();
+			for_each_position(*set, [&](int pos)
+							  { listed.push_back(pos); });
+			if (listed.size() > from)
+			{
+				first = std::min<int64_t>(first, listed[from]);
+				last = std::max<int64_t>(last, listed.back() + int64_t(1));
+			}
+		}
+	}
+	if (first >= last)
+	{
+		return BitmapSet{Array<uint64_t>(), 0, 0};
+	}
+
+	std::vector<uint64_t> words(bitmap_words(last - first), 0);
+	for (const MatchSet *set : {&A, &B})
+	{
+		if (const BitmapSet *bitmap = std::get_if<BitmapSet>(&set->set))
+		{
+			for (size_t w = 0; w < words.size(); w++)
+			{
+				words[w] |= bitmap_word(*bitmap, first + static_cast<int64_t>(64 * w));
+			}
+		}
+	}
+	for (int pos : listed)
+	{
+		int64_t bit = pos - first;
+		words[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+	size_t size = 0;
+	for (uint64_t word : words)
+	{
+		size += std::popcount(word);
+	}
+	return BitmapSet{Array<uint64_t>(std::move(words)), static_cast<int>(first), size};
+}
+
+// a copy of a bitmap without the positions of a list
+template <typename S>
+BitmapSet clear_list(const BitmapSet &bitmap, const S &list)
+{
+	std::vector<uint64_t> words(bitmap.words.begin(), bitmap.words.end());
+	size_t size = bitmap.size;
+	for_each_position(list, [&](int pos)
+					  {
+		int64_t bit = static_cast<int64_t>(pos) - bitmap.shift;
+		if (bit >= 0 && bit < static_cast<int64_t>(words.size() * 64))
+		{
+			uint64_t mask = uint64_t(1) << (bit % 64);
+			size -= (words[bit / 64] & mask) != 0;
+			words[bit / 64] &= ~mask;
+		} });
+	return BitmapSet{Array<uint64_t>(std::move(words)), bitmap.shift, size};
+}
+
+ExplicitSet intersection(const BitmapSet &A, const IndexSet &B)
+{
+	return filter_list(B, A, true);
+}
+
+ExplicitSet intersection(const BitmapSet &A, const ExplicitSet &B)
+{
+	return filter_list(B, A, true);
+}
+
+ExplicitSet intersection(const BitmapSet &A, const CompressedSet &B)
+{
+	return filter_list(B, A, true);
+}
+
+ExplicitSet intersection(const IndexSet &A, const BitmapSet &B)
+{
+	return filter_list(A, B, true);
+}
+
+ExplicitSet intersection(const ExplicitSet &A, const BitmapSet &B)
+{
+	return filter_list(A, B, true);
+}
+
+ExplicitSet intersection(const CompressedSet &A, const BitmapSet &B)
+{
+	return filter_list(A, B, true);
+}
+
+BitmapSet difference(const BitmapSet &A, const IndexSet &B)
+{
+	return clear_list(A, B);
+}
+
+BitmapSet difference(const BitmapSet &A, const ExplicitSet &B)
+{
+	return clear_list(A, B);
+}
+
+BitmapSet difference(const BitmapSet &A, const CompressedSet &B)
+{
+	return clear_list(A, B);
+}
+
+ExplicitSet difference(const IndexSet &A, const BitmapSet &B)
+{
+	return filter_list(A, B, false);
+}
+
+ExplicitSet difference(const ExplicitSet &A, const BitmapSet &B)
+{
+	return filter_list(A, B, false);
+}
+
+ExplicitSet difference(const CompressedSet &A, const BitmapSet &B)
+{
+	return filter_list(A, B, false);
+}
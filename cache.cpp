@@ -0,0 +1,181 @@
+#include "corpus.h"
+#include <algorithm>
+#include <tuple>
+
+// a query missing from the result cache is planned from the sets of its
+// literals as usual, except that every clause with several literals whose
+// set is cached is answered by it in place of the sets of its literals.
+// the planner is told that the clause set answers all of them, so it may
+// still check them on the columns instead. the clause sets are only found
+// once a query has run (add_clauses), its first matches do not wait for
+// them
+
+std::string query_key(const Query &query)
+{
+	std::string key;
+	for (const Clause &clause : query)
+	{
+		Clause literals = clause;
+		auto order = [](const Literal &a, const Literal &b)
+		{
+			return std::tuple(a.attribute, a.is_equality, a.value) < std::tuple(b.attribute, b.is_equality, b.value);
+		};
+		auto same = [](const Literal &a, const Literal &b)
+		{
+			return a.attribute == b.attribute && a.is_equality == b.is_equality && a.value == b.value;
+		};
+		std::sort(literals.begin(), literals.end(), order);
+		literals.erase(std::unique(literals.begin(), literals.end(), same), literals.end());
+		key += '[';
+		for (const Literal &literal : literals)
+		{
+			key += static_cast<char>(literal.attribute);
+			key += literal.is_equality ? '=' : '!';
+			key.append(reinterpret_cast<const char *>(&literal.value), sizeof(literal.value));
+		}
+		key += ']';
+	}
+	return key;
+}
+
+// the set of a clause moved to the clause's place in a query. a list
+// owned by the cache is viewed like a posting list. none for a dense set,
+// which has no shift
+std::optional<MatchSet> shift_set(const MatchSet &set, int shift)
+{
+	MatchSet shifted;
+	shifted.complement = set.complement;
+	if (const ExplicitSet *list = std::get_if<ExplicitSet>(&set.set))
+	{
+		shifted.set = IndexSet{list->elems, shift};
+	}
+	else if (const IndexSet *list = std::get_if<IndexSet>(&set.set))
+	{
+		shifted.set = IndexSet{list->elems, list->shift + shift};
+	}
+	else if (const CompressedSet *list = std::get_if<CompressedSet>(&set.set))
+	{
+		CompressedSet moved = *list;
+		moved.shift += shift;
+		shifted.set = moved;
+	}
+	else if (const BitmapSet *bitmap = std::get_if<BitmapSet>(&set.set))
+	{
+		BitmapSet moved = *bitmap;
+		moved.shift += shift;
+		shifted.set = std::move(moved);
+	}
+	else
+	{
+		return std::nullopt;
+	}
+	return shifted;
+}
+
+// a query of one clause is kept whole in the result cache, and a single
+// literal is a lookup in its index already
+bool has_clause_set(const Query &query, const Clause &clause)
+{
+	return query.size() > 1 && clause.size() > 1;
+}
+
+std::shared_ptr<const std::vector<Match>> QueryCache::find(const Query &query)
+{
+	return results.find(query_key(query));
+}
+
+QueryPlan QueryCache::plan(const Corpus &corpus, const Query &query, std::vector<std::shared_ptr<const MatchSet>> &held)
+{
+	bool dense_sets;
+	std::vector<std::vector<VerifiedLiteral>> sources;
+	std::vector<MatchSet> sets = query_sets(corpus, query, dense_sets, sources);
+	for (size_t i = 0; i < query.size(); i++)
+	{
+		const Clause &clause = query[i];
+		if (!has_clause_set(query, clause))
+		{
+			continue;
+		}
+		std::shared_ptr<const MatchSet> set = clauses.find(query_key(Query{clause}));
+		if (!set)
+		{
+			continue;
+		}
+		int offset = static_cast<int>(i);
+		std::optional<MatchSet> shifted = shift_set(*set, -offset);
+		if (!shifted)
+		{
+			continue;
+		}
+		// drop the sets of the clause's literals alone, those of binary
+		// indexes reaching into the next clause stay
+		size_t kept = 0;
+		for (size_t k = 0; k < sets.size(); k++)
+		{
+			bool own = std::all_of(sources[k].begin(), sources[k].end(), [&](const VerifiedLiteral &literal)
+								   { return literal.offset == offset; });
+			if (own)
+			{
+				continue;
+			}
+			if (kept != k)
+			{
+				sets[kept] = std::move(sets[k]);
+				sources[kept] = std::move(sources[k]);
+			}
+			kept++;
+		}
+		sets.resize(kept);
+		sources.resize(kept);
+
+		sets.push_back(std::move(*shifted));
+		sources.emplace_back();
+		for (const Literal &literal : clause)
+		{
+			sources.back().push_back(VerifiedLiteral{find_column(corpus, literal.attribute), literal.value, offset, literal.is_equality});
+		}
+		held.push_back(std::move(set));
+	}
+	return plan_query(corpus, query, sets, sources);
+}
+
+void QueryCache::insert(const Query &query, std::vector<Match> &&matches)
+{
+	size_t bytes = matches.size() * sizeof(Match);
+	results.insert(query_key(query), std::make_shared<const std::vector<Match>>(std::move(matches)), bytes);
+}
+
+void QueryCache::add_clauses(const Corpus &corpus, const Query &query)
+{
+	for (const Clause &clause : query)
+	{
+		Query single{clause};
+		std::string key = query_key(single);
+		if (!has_clause_set(query, clause) || clauses.contains(key))
+		{
+			continue;
+		}
+		MatchSet set = match_set(corpus, single, plan_query(corpus, single));
+		size_t bytes = sizeof(MatchSet);
+		if (ExplicitSet *list = std::get_if<ExplicitSet>(&set.set))
+		{
+			// the scratch buffer is reserved for more than it holds, the
+			// cache keeps an exact copy
+			std::vector<int> elems(list->elems.begin(), list->elems.end());
+			recycle(std::move(list->elems));
+			list->elems = std::move(elems);
+			bytes += list->elems.size() * sizeof(int);
+		}
+		else if (const BitmapSet *bitmap = std::get_if<BitmapSet>(&set.set))
+		{
+			bytes += bitmap->words.size() * sizeof(uint64_t);
+		}
+		clauses.insert(key, std::make_shared<const MatchSet>(std::move(set)), bytes);
+	}
+}
+
+void QueryCache::clear()
+{
+	results.clear();
+	clauses.clear();
+}
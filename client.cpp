@@ -0,0 +1,165 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// a client for the query server (corpus --serve): sends every line of
+// stdin, or the request given on the command line, and prints the JSON
+// lines of the response
+
+void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " <socket | port> [request]" << std::endl
+			  << "  without a request, one request is read per line of stdin" << std::endl;
+}
+
+// a unix socket for an address with a '/', else a port on localhost;
+// reports why on failure and returns -1
+int connect_socket(const std::string &address)
+{
+	int fd;
+	int result;
+	if (address.find('/') != std::string::npos)
+	{
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(addr.sun_path))
+		{
+			std::cerr << "Error: socket path " << address << " is too long" << std::endl;
+			return -1;
+		}
+		std::strcpy(addr.sun_path, address.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		result = fd < 0 ? -1 : connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+	}
+	else
+	{
+		uint16_t port = 0;
+		auto [end, error] = std::from_chars(address.data(), address.data() + address.size(), port);
+		if (error != std::errc() || end != address.data() + address.size() || port == 0)
+		{
+			std::cerr << "Error: " << address << " is not a port; give a socket path with a '/', e.g. ./" << address << std::endl;
+			return -1;
+		}
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(port);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		result = fd < 0 ? -1 : connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+	}
+	if (result < 0)
+	{
+		std::cerr << "Error: cannot connect to " << address << ": " << std::strerror(errno) << std::endl;
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+bool send_all(int fd, const std::string &data)
+{
+	size_t sent = 0;
+	while (sent < data.size())
+	{
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
+
+// prints response lines up to the status line that ends every response,
+// the only one that is not a match. false if the server hung up
+bool print_response(int fd, std::string &pending)
+{
+	char chunk[1 << 16];
+	while (true)
+	{
+		size_t end;
+		while ((end = pending.find('\n')) != std::string::npos)
+		{
+			std::string line = pending.substr(0, end);
+			pending.erase(0, end + 1);
+			std::cout << line << '\n';
+			if (!line.starts_with("{\"sentence\""))
+			{
+				std::cout.flush();
+				return true;
+			}
+		}
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		pending.append(chunk, n);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+	int fd = connect_socket(argv[1]);
+	if (fd < 0)
+	{
+		return 1;
+	}
+
+	std::string pending;
+	if (argc > 2)
+	{
+		std::string request = argv[2];
+		for (int i = 3; i < argc; i++)
+		{
+			request += ' ';
+			request += argv[i];
+		}
+		bool answered = send_all(fd, request + "\n") && print_response(fd, pending);
+		close(fd);
+		return answered ? 0 : 1;
+	}
+
+	std::string line;
+	while (std::getline(std::cin, line))
+	{
+		if (line.empty())
+		{
+			continue;
+		}
+		if (!send_all(fd, line + "\n"))
+		{
+			break;
+		}
+		if (line == "quit" || !print_response(fd, pending))
+		{
+			break;
+		}
+	}
+	close(fd);
+	return 0;
+}
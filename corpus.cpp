@@ -1,298 +1,637 @@
 #include "corpus.h"
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
 
 const double SIZE_RATIO = 5.0;
 
-uint32_t getStringID(Corpus &corpus, std::string &str)
+uint64_t hash_string(std::string_view str)
 {
-	auto iter = corpus.string2index.find(str);
-
-	if (iter != corpus.string2index.end())
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (char c : str)
 	{
-		// already in map return index
-		return iter->second;
-	}
-	else
-	{
-		// get the id of the new string
-		uint32_t id = corpus.index2string.size();
-		// add the string
-		corpus.index2string.push_back(str);
-		// map it to the new id
-		corpus.string2index[str] = id;
-		return id;
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
 	}
+	return hash;
 }
 
-Corpus load_corpus(const std::string &filename)
+uint32_t Vocabulary::find(std::string_view str) const
 {
-	Corpus corpus;
-	std::ifstream file(filename);
-	if (!file.is_open())
+	if (slots.empty())
 	{
-		std::cerr << "Error: could not open file " << filename << std::endl;
-		return corpus;
+		return NO_ID;
 	}
-
-	std::string line;
-	// skip the first line of the file
-	std::getline(file, line);
-	int pos = 0;
-	corpus.sentences.push_back(pos);
-
-	while (std::getline(file, line))
+	size_t mask = slots.size() - 1;
+	for (size_t slot = hash_string(str) & mask;; slot = (slot + 1) & mask)
 	{
-		// check if line is a comment
-		if (line[0] == '#')
+		uint32_t id = slots[slot];
+		if (id == NO_ID || strings[id] == str)
 		{
-			continue;
+			return id;
 		}
+	}
+}
 
-		if (line.empty())
+VocabularyBuilder::VocabularyBuilder() : offsets{0}, slots(16, NO_ID) {}
+
+std::string_view VocabularyBuilder::operator[](size_t id) const
+{
+	return std::string_view(chars.data() + offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+uint32_t VocabularyBuilder::intern(std::string_view str)
+{
+	size_t mask = slots.size() - 1;
+	size_t slot = hash_string(str) & mask;
+	while (slots[slot] != NO_ID)
+	{
+		if ((*this)[slots[slot]] == str)
 		{
-			corpus.sentences.push_back(pos);
+			return slots[slot];
 		}
-		else
+		slot = (slot + 1) & mask;
+	}
+
+	// new string, keep the table at most half full
+	uint32_t id = size();
+	chars.insert(chars.end(), str.begin(), str.end());
+	offsets.push_back(chars.size());
+	slots[slot] = id;
+	if (size() * 2 > slots.size())
+	{
+		grow();
+	}
+	return id;
+}
+
+void VocabularyBuilder::grow()
+{
+	slots.assign(slots.size() * 2, NO_ID);
+	size_t mask = slots.size() - 1;
+	for (uint32_t id = 0; id < size(); id++)
+	{
+		size_t slot = hash_string((*this)[id]) & mask;
+		while (slots[slot] != NO_ID)
 		{
-			Token token;
-			std::string word_str, c5_str, lemma_str, pos_str;
-			std::istringstream iss(line);
-			iss >> word_str >> c5_str >> lemma_str >> pos_str;
-			// lookup variables
-			token.word = getStringID(corpus, word_str);
-			token.c5 = getStringID(corpus, c5_str);
-			token.lemma = getStringID(corpus, lemma_str);
-			token.pos = getStringID(corpus, pos_str);
-
-			corpus.tokens.push_back(token);
-			pos++;
+			slot = (slot + 1) & mask;
 		}
+		slots[slot] = id;
 	}
-
-	return corpus;
 }
 
-std::vector<Match> match(const Corpus &corpus, const std::string &query_string)
+Vocabulary VocabularyBuilder::finish()
 {
-	return match(corpus, parse_query(query_string, corpus));
+	Vocabulary vocabulary;
+	vocabulary.strings.chars = std::move(chars);
+	vocabulary.strings.offsets = std::move(offsets);
+	vocabulary.slots = std::move(slots);
+	*this = VocabularyBuilder();
+	return vocabulary;
 }
 
-bool matchesLiteral(const Corpus &corpus, const Token &token, const Literal &literal)
+std::optional<Attribute> find_attribute(std::string_view name)
 {
-	bool match = false;
-	// if value is -1 we already know there are no match
-	if (static_cast<int>(literal.value) == -1)
+	if (name == "word")
 	{
-		return false;
+		return Attribute::word;
 	}
-	if (literal.attribute == "word")
+	else if (name == "c5")
 	{
-		match = (corpus.index2string[literal.value] == corpus.index2string[token.word]);
+		return Attribute::c5;
 	}
-	else if (literal.attribute == "c5")
+	else if (name == "lemma")
 	{
-		match = (corpus.index2string[literal.value] == corpus.index2string[token.c5]);
+		return Attribute::lemma;
 	}
-	else if (literal.attribute == "lemma")
+	else if (name == "pos")
 	{
-		match = (corpus.index2string[literal.value] == corpus.index2string[token.lemma]);
+		return Attribute::pos;
 	}
-	else if (literal.attribute == "pos")
-	{
-		match = (corpus.index2string[literal.value] == corpus.index2string[token.pos]);
+	return std::nullopt;
+}
+
+std::string_view attribute_name(Attribute attribute)
+{
+	switch (attribute)
+	{
+	case Attribute::word:
+		return "word";
+	case Attribute::c5:
+		return "c5";
+	case Attribute::lemma:
+		return "lemma";
+	case Attribute::pos:
+		return "pos";
+	default:
+		return "match all";
 	}
-	else if (literal.attribute == "match all")
-	{
-		return true;
+}
+
+const Vocabulary *find_vocabulary(const Corpus &corpus, Attribute attribute)
+{
+	switch (attribute)
+	{
+	case Attribute::word:
+		return &corpus.word_vocab;
+	case Attribute::c5:
+		return &corpus.c5_vocab;
+	case Attribute::lemma:
+		return &corpus.lemma_vocab;
+	case Attribute::pos:
+		return &corpus.pos_vocab;
+	default:
+		return nullptr;
 	}
+}
 
-	return literal.is_equality ? match : !match;
+const Column *find_column(const Corpus &corpus, Attribute attribute)
+{
+	switch (attribute)
+	{
+	case Attribute::word:
+		return &corpus.word_column;
+	case Attribute::c5:
+		return &corpus.c5_column;
+	case Attribute::lemma:
+		return &corpus.lemma_column;
+	case Attribute::pos:
+		return &corpus.pos_column;
+	default:
+		return nullptr;
+	}
 }
 
-std::vector<Match> match(const Corpus &corpus, const Query &query)
+// part of the corpus file parsed by one thread, ids are local to the chunk
+struct LoadChunk
 {
-	std::vector<Match> matches;
-	// iterate over each sentence
-	for (size_t i = 0; i < corpus.sentences.size(); i++)
-	{
-		size_t clause_matches = 0;
-		// get scentence lenght
-		int sentence_lenght = corpus.sentences[i + 1] - corpus.sentences[i];
-		int start = corpus.sentences[i];
-		int end = start + sentence_lenght;
+	const char *begin;
+	const char *end;
+	size_t tokens = 0;
+	std::vector<int> sentences;			  // chunk positions where a new sentence starts
+	VocabularyBuilder vocabs[4];		  // attributes in file order: word, c5, lemma, pos
+	std::vector<uint32_t> ids[4];		  // local id of every token per attribute
+	std::vector<uint32_t> global_ids[4]; // local id to corpus id per attribute
+};
+
+bool is_field_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
 
-		int pos = 0;
+void parse_chunk(LoadChunk &chunk)
+{
+	const char *line = chunk.begin;
+	while (line < chunk.end)
+	{
+		const char *line_end = static_cast<const char *>(std::memchr(line, '\n', chunk.end - line));
+		if (line_end == nullptr)
+		{
+			line_end = chunk.end;
+		}
 
-		for (int j = corpus.sentences[i]; j < end; j++)
+		if (line == line_end)
+		{
+			// empty line, a new sentence starts
+			chunk.sentences.push_back(chunk.tokens);
+		}
+		else if (*line != '#')
 		{
-			bool match_found = true;
-			int current_token = j;
-			// iterate over
-			while (clause_matches < query.size() && current_token < end)
+			// split into the four whitespace separated attributes
+			std::string_view fields[4];
+			const char *p = line;
+			for (std::string_view &field : fields)
 			{
-				const Clause &clause = query[clause_matches];
-				bool clause_match = true;
-
-				// check all literals in the clause
-				for (const Literal &literal : clause)
+				while (p < line_end && is_field_space(*p))
 				{
-					if (!matchesLiteral(corpus, corpus.tokens[current_token], literal))
-					{
-						clause_match = false;
-						break;
-					}
+					p++;
 				}
-
-				// match found, move to next clause and token
-				if (clause_match)
+				const char *field_start = p;
+				while (p < line_end && !is_field_space(*p))
 				{
-					clause_matches++;
-					current_token++;
-				}
-				else
-				{
-					match_found = false;
-					break;
+					p++;
 				}
+				field = std::string_view(field_start, p - field_start);
 			}
 
-			// check if all matches where found
-			if (match_found && clause_matches == query.size())
+			for (int attribute = 0; attribute < 4; attribute++)
 			{
-				Match match;
-				match.sentence = i;
-				match.pos = pos;
-				match.len = static_cast<int>(query.size());
-				matches.push_back(match);
+				chunk.ids[attribute].push_back(chunk.vocabs[attribute].intern(fields[attribute]));
 			}
+			chunk.tokens++;
+		}
+		line = line_end + 1;
+	}
+}
 
-			// reset for next token
-			clause_matches = 0;
-			pos++;
+// split [begin, end) into roughly equal parts that start on a line after a
+// sentence break (or at least on a line start)
+std::vector<LoadChunk> split_chunks(const char *begin, const char *end)
+{
+	const size_t min_chunk_size = 1 << 20;
+	size_t size = end - begin;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	size_t count = std::max<size_t>(1, std::min(threads, size / min_chunk_size));
+
+	std::string_view data(begin, size);
+	std::vector<const char *> bounds{begin};
+	for (size_t i = 1; i < count; i++)
+	{
+		size_t target = std::max<size_t>(size * i / count, bounds.back() - begin);
+		size_t split = data.find("\n\n", target);
+		if (split != std::string_view::npos)
+		{
+			split += 2;
 		}
+		else
+		{
+			split = data.find('\n', target);
+			if (split == std::string_view::npos)
+			{
+				break;
+			}
+			split += 1;
+		}
+		if (begin + split >= end)
+		{
+			break;
+		}
+		bounds.push_back(begin + split);
 	}
+	bounds.push_back(end);
 
-	return matches;
+	std::vector<LoadChunk> chunks(bounds.size() - 1);
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		chunks[i].begin = bounds[i];
+		chunks[i].end = bounds[i + 1];
+	}
+	return chunks;
+}
+
+// translate the chunk ids of one attribute to corpus ids, stored as T
+template <typename T>
+Array<T> pack_column(const std::vector<LoadChunk> &chunks, int attribute, size_t total_tokens)
+{
+	std::vector<T> values(total_tokens);
+	std::vector<std::thread> workers;
+	size_t offset = 0;
+	for (const LoadChunk &chunk : chunks)
+	{
+		workers.emplace_back([&values, &chunk, attribute, offset]
+							 {
+			const std::vector<uint32_t> &ids = chunk.ids[attribute];
+			const std::vector<uint32_t> &global_ids = chunk.global_ids[attribute];
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				values[offset + i] = global_ids[ids[i]];
+			} });
+		offset += chunk.tokens;
+	}
+	for (std::thread &worker : workers)
+	{
+		worker.join();
+	}
+	return values;
 }
-Index build_index(const std::vector<Token> &tokens, uint32_t Token::*attribute)
+
+Column make_column(const std::vector<LoadChunk> &chunks, int attribute, size_t total_tokens, size_t vocab_size)
 {
-	Index index(tokens.size());
+	Column column;
+	if (vocab_size <= 1 << 8)
+	{
+		column.values = pack_column<uint8_t>(chunks, attribute, total_tokens);
+	}
+	else if (vocab_size <= 1 << 16)
+	{
+		column.values = pack_column<uint16_t>(chunks, attribute, total_tokens);
+	}
+	else
+	{
+		column.values = pack_column<uint32_t>(chunks, attribute, total_tokens);
+	}
+	return column;
+}
 
-	for (size_t i = 0; i < tokens.size(); i++)
+Corpus load_corpus(const std::string &filename)
+{
+	Corpus corpus;
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
 	{
-		index[i] = i;
+		std::cerr << "Error: could not open file " << filename << std::endl;
+		return corpus;
 	}
 
-	std::stable_sort(index.begin(), index.end(), [&](int a, int b)
-					 { return tokens[a].*attribute < tokens[b].*attribute; });
+	// read the whole file as one block
+	std::vector<char> data(file.tellg());
+	file.seekg(0);
+	file.read(data.data(), data.size());
+	data.resize(file.gcount());
 
-	return index;
+	const char *begin = data.data();
+	const char *end = data.data() + data.size();
+	// skip the first line of the file; an empty file has no data to search
+	const char *first_line_end = data.empty() ? nullptr : static_cast<const char *>(std::memchr(begin, '\n', data.size()));
+	begin = first_line_end == nullptr ? end : first_line_end + 1;
+
+	// parse the chunks in parallel, each with its own string ids
+	std::vector<LoadChunk> chunks = split_chunks(begin, end);
+	std::vector<std::thread> workers;
+	for (LoadChunk &chunk : chunks)
+	{
+		workers.emplace_back(parse_chunk, std::ref(chunk));
+	}
+	for (std::thread &worker : workers)
+	{
+		worker.join();
+	}
+
+	// merge the chunk ids in file order so ids match a sequential load
+	VocabularyBuilder vocabs[4];
+	size_t total_tokens = 0;
+	for (LoadChunk &chunk : chunks)
+	{
+		for (int attribute = 0; attribute < 4; attribute++)
+		{
+			const VocabularyBuilder &local = chunk.vocabs[attribute];
+			std::vector<uint32_t> &global_ids = chunk.global_ids[attribute];
+			global_ids.reserve(local.size());
+			for (size_t id = 0; id < local.size(); id++)
+			{
+				global_ids.push_back(vocabs[attribute].intern(local[id]));
+			}
+		}
+		total_tokens += chunk.tokens;
+	}
+
+	std::vector<int> sentences;
+	sentences.push_back(0);
+	size_t offset = 0;
+	for (const LoadChunk &chunk : chunks)
+	{
+		for (int sentence : chunk.sentences)
+		{
+			sentences.push_back(offset + sentence);
+		}
+		offset += chunk.tokens;
+	}
+
+	corpus.word_column = make_column(chunks, 0, total_tokens, vocabs[0].size());
+	corpus.c5_column = make_column(chunks, 1, total_tokens, vocabs[1].size());
+	corpus.lemma_column = make_column(chunks, 2, total_tokens, vocabs[2].size());
+	corpus.pos_column = make_column(chunks, 3, total_tokens, vocabs[3].size());
+	corpus.sentences = std::move(sentences);
+	corpus.word_vocab = vocabs[0].finish();
+	corpus.c5_vocab = vocabs[1].finish();
+	corpus.lemma_vocab = vocabs[2].finish();
+	corpus.pos_vocab = vocabs[3].finish();
+	return corpus;
+}
+
+std::vector<Match> match(const Corpus &corpus, const std::string &query_string)
+{
+	return match(corpus, parse_query(query_string, corpus));
 }
 
-void build_indices(Corpus &corpus)
+std::vector<Match> match(const Corpus &corpus, const Query &query)
 {
-	corpus.c5_index = build_index(corpus.tokens, &Token::c5);
-	corpus.lemma_index = build_index(corpus.tokens, &Token::lemma);
-	corpus.word_index = build_index(corpus.tokens, &Token::word);
-	corpus.pos_index = build_index(corpus.tokens, &Token::pos);
+	return run_scan(corpus, compile_scan(corpus, query));
 }
 
-IndexSet index_lookup(const Corpus &corpus, const std::string &attribute, uint32_t value)
+// counting sort of the positions by their value: count every value, turn
+// the counts into start offsets and scatter the positions in order, which
+// keeps the positions of each value sorted. the offsets are kept so a value
+// can be looked up directly
+Index build_index(const Column &column, size_t vocab_size)
 {
-	const Index *index;
-	uint32_t Token::*attribute_ptr;
+	std::vector<int> positions(column.size());
+	std::vector<uint32_t> offsets(vocab_size + 1, 0);
+
+	std::visit([&](const auto &values)
+			   {
+		for (size_t pos = 0; pos < values.size(); pos++)
+		{
+			offsets[values[pos] + 1]++;
+		}
+		for (size_t value = 1; value <= vocab_size; value++)
+		{
+			offsets[value] += offsets[value - 1];
+		}
+		std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+		for (size_t pos = 0; pos < values.size(); pos++)
+		{
+			positions[next[values[pos]]++] = pos;
+		} },
+			   column.values);
 
-	if (attribute == "lemma")
+	Index index;
+	index.positions = std::move(positions);
+	index.offsets = std::move(offsets);
+	return index;
+}
+
+const std::vector<std::pair<std::string, std::string>> DEFAULT_BINARY_INDICES = {
+	{"pos", "lemma"},
+	{"lemma", "lemma"},
+	{"word", "word"},
+};
+
+BinaryIndex build_binary_index(const Corpus &corpus, const std::string &first, const std::string &second)
+{
+	std::optional<Attribute> first_attribute = find_attribute(first);
+	std::optional<Attribute> second_attribute = find_attribute(second);
+	if (!first_attribute || !second_attribute)
 	{
-		index = &corpus.lemma_index;
-		attribute_ptr = &Token::lemma;
+		throw std::runtime_error("Error: unknown attribute in binary index " + first + ":" + second);
 	}
-	else if (attribute == "word")
+	const Column *first_column = find_column(corpus, *first_attribute);
+	const Column *second_column = find_column(corpus, *second_attribute);
+	size_t first_values = find_vocabulary(corpus, *first_attribute)->size();
+	size_t second_values = find_vocabulary(corpus, *second_attribute)->size();
+
+	// pairs that cross a sentence boundary can never match
+	std::vector<int> pairs;
+	size_t sentence = 1;
+	for (size_t pos = 0; pos + 1 < corpus.size(); pos++)
 	{
-		index = &corpus.word_index;
-		attribute_ptr = &Token::word;
+		while (sentence < corpus.sentences.size() && static_cast<size_t>(corpus.sentences[sentence]) <= pos)
+		{
+			sentence++;
+		}
+		if (sentence == corpus.sentences.size() || static_cast<size_t>(corpus.sentences[sentence]) != pos + 1)
+		{
+			pairs.push_back(pos);
+		}
 	}
-	else if (attribute == "c5")
+
+	// radix sort: counting sort by the second value, then a stable counting
+	// sort by the first value
+	std::vector<uint32_t> counts(second_values + 1, 0);
+	for (int pos : pairs)
 	{
-		index = &corpus.c5_index;
-		attribute_ptr = &Token::c5;
+		counts[(*second_column)[pos + 1] + 1]++;
 	}
-	else if (attribute == "pos")
+	for (size_t value = 1; value <= second_values; value++)
 	{
-		index = &corpus.pos_index;
-		attribute_ptr = &Token::pos;
+		counts[value] += counts[value - 1];
 	}
-	else
+	std::vector<int> by_second(pairs.size());
+	for (int pos : pairs)
 	{
-		// not possible to reach this since parser checks the atributes
-		exit(1);
+		by_second[counts[(*second_column)[pos + 1]]++] = pos;
 	}
 
-	auto begin = index->begin();
-	auto end = index->end();
-
-	auto first = std::lower_bound(begin, end, value,
-								  [&](int pos, uint32_t val)
-								  {
-									  return corpus.tokens[pos].*attribute_ptr < val;
-								  });
-
-	// find the position after the last occurrence of the value
-	auto last = std::upper_bound(first, end, value,
-								 [&](uint32_t val, int pos)
-								 {
-									 return val < corpus.tokens[pos].*attribute_ptr;
-								 });
-
-	size_t first_index = std::distance(begin, first);
-	size_t last_index = std::distance(begin, last);
+	std::vector<uint32_t> offsets(first_values + 1, 0);
+	for (int pos : by_second)
+	{
+		offsets[(*first_column)[pos] + 1]++;
+	}
+	for (size_t value = 1; value <= first_values; value++)
+	{
+		offsets[value] += offsets[value - 1];
+	}
+	std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+	std::vector<int> positions(pairs.size());
+	std::vector<uint32_t> seconds(pairs.size());
+	for (int pos : by_second)
+	{
+		uint32_t slot = next[(*first_column)[pos]]++;
+		positions[slot] = pos;
+		seconds[slot] = (*second_column)[pos + 1];
+	}
 
-	IndexSet index_set;
-	index_set.elems = std::span<const int>(index->begin() + first_index, last_index - first_index);
-	index_set.shift = 0;
-	return index_set;
+	BinaryIndex index;
+	index.first = *first_attribute;
+	index.second = *second_attribute;
+	index.positions = std::move(positions);
+	index.offsets = std::move(offsets);
+	index.seconds = std::move(seconds);
+	return index;
 }
 
-std::vector<Match> match_single(const Corpus &corpus, const std::string &attr, const std::string &value)
+std::span<const int> BinaryIndex::lookup(uint32_t first_value, uint32_t second_value) const
 {
-	IndexSet index_set = index_lookup(corpus, attr, corpus.string2index.find(value)->second);
-	std::vector<Match> matches;
+	if (offsets.empty() || first_value >= offsets.size() - 1)
+	{
+		return {};
+	}
+	// the entries of the first value are sorted by their second value
+	auto begin = seconds.begin() + offsets[first_value];
+	auto end = seconds.begin() + offsets[first_value + 1];
+	auto [first, last] = std::equal_range(begin, end, second_value);
+	return positions.span().subspan(first - seconds.begin(), last - first);
+}
 
-	int sentence_index = 0;
-	for (int token_pos : index_set.elems)
+Array<uint8_t> build_sentence_room(const Corpus &corpus)
+{
+	std::vector<uint8_t> room(corpus.size() + ROOM_PADDING, 0);
+	const Array<int> &sentences = corpus.sentences;
+	for (size_t i = 0; i < sentences.size(); i++)
 	{
-		int found_sentence_start = -1;
+		int end = i + 1 < sentences.size() ? sentences[i + 1] : static_cast<int>(corpus.size());
+		for (int pos = sentences[i]; pos < end; pos++)
+		{
+			room[pos] = std::min(end - pos, MAX_ROOM);
+		}
+	}
+	return room;
+}
 
-		for (size_t i = sentence_index + 1; i < corpus.sentences.size(); i++)
+void build_indices(Corpus &corpus, const IndexOptions &options)
+{
+	const auto &binary_indices = options.binary_indices;
+	// builds one unary index, compressing it if asked to
+	auto unary = [&](Index &index, const Column &column, size_t vocab_size)
+	{
+		index = build_index(column, vocab_size);
+		build_bitmaps(index, column);
+		if (options.compress_postings)
 		{
-			if (corpus.sentences[i] > token_pos)
-			{
-				found_sentence_start = i;
-				break;
-			}
+			index.compressed = compress_postings(index);
+			index.positions = Array<int>();
 		}
-		if (found_sentence_start == -1)
+	};
+
+	// the indexes are independent, build them side by side
+	std::vector<std::thread> workers;
+	workers.reserve(5 + binary_indices.size());
+	workers.emplace_back([&]
+						 { unary(corpus.c5_index, corpus.c5_column, corpus.c5_vocab.size()); });
+	workers.emplace_back([&]
+						 { unary(corpus.lemma_index, corpus.lemma_column, corpus.lemma_vocab.size()); });
+	workers.emplace_back([&]
+						 { unary(corpus.word_index, corpus.word_column, corpus.word_vocab.size()); });
+	workers.emplace_back([&]
+						 { unary(corpus.pos_index, corpus.pos_column, corpus.pos_vocab.size()); });
+	workers.emplace_back([&]
+						 { corpus.sentence_room = build_sentence_room(corpus); });
+
+	for (const auto &[first, second] : binary_indices)
+	{
+		if (!find_attribute(first) || !find_attribute(second))
 		{
-			continue;
+			for (std::thread &worker : workers)
+			{
+				worker.join();
+			}
+			throw std::runtime_error("Error: unknown attribute in binary index " + first + ":" + second);
 		}
+	}
+	corpus.binary_indices.resize(binary_indices.size());
+	for (size_t i = 0; i < binary_indices.size(); i++)
+	{
+		workers.emplace_back([&, i]
+							 { corpus.binary_indices[i] = build_binary_index(corpus, binary_indices[i].first, binary_indices[i].second); });
+	}
 
-		sentence_index = found_sentence_start - 1;
+	for (std::thread &worker : workers)
+	{
+		worker.join();
+	}
+}
 
-		// get the sentence start and tokens pos
-		int sentence_start = corpus.sentences[sentence_index];
-		int pos_in_sentence = token_pos - sentence_start;
+const Index *find_index(const Corpus &corpus, Attribute attribute)
+{
+	switch (attribute)
+	{
+	case Attribute::word:
+		return &corpus.word_index;
+	case Attribute::c5:
+		return &corpus.c5_index;
+	case Attribute::lemma:
+		return &corpus.lemma_index;
+	case Attribute::pos:
+		return &corpus.pos_index;
+	default:
+		return nullptr;
+	}
+}
 
-		Match match;
-		match.sentence = sentence_index;
-		match.pos = pos_in_sentence;
-		match.len = 1;
-		matches.push_back(match);
+IndexSet index_lookup(const Corpus &corpus, Attribute attribute, uint32_t value)
+{
+	const Index *index = find_index(corpus, attribute);
+	if (index == nullptr)
+	{
+		// not possible to reach this since parser checks the atributes
+		exit(1);
 	}
 
-	return matches;
+	IndexSet index_set;
+	index_set.elems = index->lookup(value);
+	index_set.shift = 0;
+	return index_set;
+}
+
+std::vector<Match> match_single(const Corpus &corpus, const std::string &attr, const std::string &value)
+{
+	Attribute attribute = *find_attribute(attr);
+	Literal literal{attribute, find_vocabulary(corpus, attribute)->find(value), true};
+	return match2(corpus, Query{Clause{literal}});
 }
 
 MatchSet intersection(const MatchSet &A, const MatchSet &B)
@@ -301,28 +640,28 @@ MatchSet intersection(const MatchSet &A, const MatchSet &B)
 
 	if (A.complement && B.complement)
 	{
-		result.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>
-								{ return intersection(a, b); }, A.set, B.set);
+		// in neither set: the complement of their union
+		result = union_sets(A, B);
 		result.complement = true;
 		return result;
 	}
 	else if (A.complement)
 	{
-		result.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>
+		result.set = std::visit([](auto &&a, auto &&b) -> decltype(MatchSet::set)
 								{ return difference(b, a); }, A.set, B.set);
 		result.complement = false;
 		return result;
 	}
 	else if (B.complement)
 	{
-		result.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>
+		result.set = std::visit([](auto &&a, auto &&b) -> decltype(MatchSet::set)
 								{ return difference(a, b); }, A.set, B.set);
 		result.complement = false;
 		return result;
 	}
 	else
 	{
-		result.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>
+		result.set = std::visit([](auto &&a, auto &&b) -> decltype(MatchSet::set)
 								{ return intersection(a, b); }, A.set, B.set);
 		result.complement = false;
 		return result;
@@ -330,6 +669,29 @@ MatchSet intersection(const MatchSet &A, const MatchSet &B)
 	return result;
 }
 
+MatchSet union_sets(const MatchSet &A, const MatchSet &B)
+{
+	MatchSet result;
+	result.complement = false;
+	if (std::holds_alternative<BitmapSet>(A.set) || std::holds_alternative<BitmapSet>(B.set))
+	{
+		result.set = bitmap_union(A, B);
+		return result;
+	}
+	std::vector<int> a = scratch_positions(get_set_size(A));
+	std::vector<int> b = scratch_positions(get_set_size(B));
+	for_each_position(A, [&](int pos)
+					  { a.push_back(pos); });
+	for_each_position(B, [&](int pos)
+					  { b.push_back(pos); });
+	ExplicitSet both = scratch_set(a.size() + b.size());
+	std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(both.elems));
+	recycle(std::move(a));
+	recycle(std::move(b));
+	result.set = std::move(both);
+	return result;
+}
+
 DenseSet intersection(const DenseSet &A, const DenseSet &B)
 {
 	// std::cout << "Funktion 1" << std::endl;
@@ -351,44 +713,20 @@ DenseSet intersection(const DenseSet &A, const DenseSet &B)
 ExplicitSet intersection(const ExplicitSet &A, const ExplicitSet &B)
 {
 	// std::cout << "Funktion 2" << std::endl;
-	ExplicitSet result;
+	if (B.elems.size() * SIZE_RATIO < A.elems.size())
+	{
+		return intersection(B, A);
+	}
+	ExplicitSet result = scratch_set(std::min(A.elems.size(), B.elems.size()));
 
 	if (A.elems.size() * SIZE_RATIO < B.elems.size())
 	{
-		for (int elem : A.elems)
-		{
-			if (std::binary_search(B.elems.begin(), B.elems.end(), elem))
-			{
-				result.elems.push_back(elem);
-			}
-		}
+		gallop_intersection(A.elems, 0, B.elems, 0, result.elems);
 		return result;
 	}
-	else if (B.elems.size() * SIZE_RATIO < A.elems.size())
-	{
-		return intersection(B, A);
-	}
 	else
 	{
-		size_t p = 0, q = 0;
-
-		while (p < A.elems.size() && q < B.elems.size())
-		{
-			if (A.elems[p] < B.elems[q])
-			{
-				++p;
-			}
-			else if (B.elems[q] < A.elems[p])
-			{
-				++q;
-			}
-			else
-			{
-				result.elems.push_back(A.elems[p]);
-				++p;
-				++q;
-			}
-		}
+		merge_intersection(A.elems, 0, B.elems, 0, result.elems);
 		return result;
 	}
 }
@@ -396,48 +734,18 @@ ExplicitSet intersection(const ExplicitSet &A, const ExplicitSet &B)
 ExplicitSet intersection(const IndexSet &A, const IndexSet &B)
 {
 	// std::cout << "Funktion 3" << std::endl;
-	ExplicitSet result;
-	if (A.elems.size() * SIZE_RATIO < B.elems.size())
+	if (B.elems.size() * SIZE_RATIO < A.elems.size())
 	{
-		for (int elem : A.elems)
-		{
-			int shifted_elem = elem + A.shift;
-			int target = shifted_elem - B.shift;
-
-			if (std::binary_search(B.elems.begin(), B.elems.end(), target))
-			{
-				result.elems.push_back(shifted_elem);
-			}
-		}
+		return intersection(B, A);
 	}
-	else if (B.elems.size() * SIZE_RATIO < A.elems.size())
+	ExplicitSet result = scratch_set(std::min(A.elems.size(), B.elems.size()));
+	if (A.elems.size() * SIZE_RATIO < B.elems.size())
 	{
-		return intersection(B, A);
+		gallop_intersection(A.elems, A.shift, B.elems, B.shift, result.elems);
 	}
-
 	else
 	{
-		size_t p = 0, q = 0;
-		while (p < A.elems.size() && q < B.elems.size())
-		{
-			int shifted_a_elem = A.elems[p] + A.shift;
-			int shifted_b_elem = B.elems[q] + B.shift;
-
-			if (shifted_a_elem < shifted_b_elem)
-			{
-				++p;
-			}
-			else if (shifted_b_elem < shifted_a_elem)
-			{
-				++q;
-			}
-			else
-			{
-				result.elems.push_back(shifted_a_elem);
-				++p;
-				++q;
-			}
-		}
+		merge_intersection(A.elems, A.shift, B.elems, B.shift, result.elems);
 	}
 
 	return result;
@@ -445,7 +753,7 @@ ExplicitSet intersection(const IndexSet &A, const IndexSet &B)
 ExplicitSet intersection(const DenseSet &A, const ExplicitSet &B)
 {
 	// std::cout << "Funktion 4" << std::endl;
-	ExplicitSet result;
+	ExplicitSet result = scratch_set(B.elems.size());
 	for (int elem : B.elems)
 	{
 		// get all the elements that is in both
@@ -460,16 +768,11 @@ ExplicitSet intersection(const DenseSet &A, const ExplicitSet &B)
 IndexSet intersection(const DenseSet &A, const IndexSet &B)
 {
 	// std::cout << "Funktion 5" << std::endl;
-	std::vector<int> result;
-	for (int elem : B.elems)
-	{
-		int shifted_elem = elem + B.shift;
-		if (shifted_elem >= A.first && shifted_elem < A.last)
-		{
-			result.push_back(elem);
-		}
-	}
-	return IndexSet{std::span<int>(result.begin(), result.end()), B.shift};
+	// the elements in the range are a part of the list, which is viewed
+	// like the list itself
+	size_t from = list_bound(B.elems, B.shift, A.first);
+	size_t to = std::max(from, list_bound(B.elems, B.shift, A.last));
+	return IndexSet{B.elems.subspan(from, to - from), B.shift};
 }
 
 ExplicitSet intersection(const ExplicitSet &B, const DenseSet &A)
@@ -486,54 +789,21 @@ IndexSet intersection(const IndexSet &B, const DenseSet &A)
 ExplicitSet intersection(const ExplicitSet &A, const IndexSet &B)
 {
 	// std::cout << "Funktion 8" << std::endl;
-	ExplicitSet result;
-
-	if (A.elems.size() < B.elems.size() * SIZE_RATIO)
-	{
-		for (int elem : A.elems)
-		{
-			int target = elem - B.shift;
-			if (std::binary_search(B.elems.begin(), B.elems.end(), target))
-			{
-				result.elems.push_back(elem);
-			}
-		}
-		return result;
-	}
-	else if (B.elems.size() < A.elems.size() * SIZE_RATIO)
-	{
-		for (int elem : B.elems)
-		{
-			int shifted_elem = elem - B.shift;
-			if (std::binary_search(A.elems.begin(), A.elems.end(), shifted_elem))
-			{
-				result.elems.push_back(shifted_elem);
-			}
-		}
-		return result;
-	}
-	else
-	{
-		size_t p = 0, q = 0;
-
-		while (p < A.elems.size() && q < B.elems.size())
-		{
-			if (A.elems[p] < B.elems[q] + B.shift)
-			{
-				++p;
-			}
-			else if (B.elems[q] + B.shift < A.elems[p])
-			{
-				++q;
-			}
-			else
-			{
-				result.elems.push_back(A.elems[p]);
-				++p;
-				++q;
-			}
-		}
+	ExplicitSet result = scratch_set(std::min(A.elems.size(), B.elems.size()));
 
+	if (A.elems.size() * SIZE_RATIO < B.elems.size())
+	{
+		gallop_intersection(A.elems, 0, B.elems, B.shift, result.elems);
+		return result;
+	}
+	else if (B.elems.size() * SIZE_RATIO < A.elems.size())
+	{
+		gallop_intersection(B.elems, B.shift, A.elems, 0, result.elems);
+		return result;
+	}
+	else
+	{
+		merge_intersection(A.elems, 0, B.elems, B.shift, result.elems);
 		return result;
 	}
 }
@@ -548,53 +818,17 @@ ExplicitSet intersection(const IndexSet &B, const ExplicitSet &A)
 ExplicitSet difference(const ExplicitSet &A, const ExplicitSet &B)
 {
 	// std::cout << "Funktion 10" << std::endl;
-	ExplicitSet result;
+	ExplicitSet result = scratch_set(A.elems.size());
 
 	if (A.elems.size() * SIZE_RATIO < B.elems.size())
 	{
-		for (int elem : A.elems)
-		{
-			if (!std::binary_search(B.elems.begin(), B.elems.end(), elem))
-			{
-				result.elems.push_back(elem);
-			}
-		}
-		return result;
-	}
-	else if (B.elems.size() * SIZE_RATIO < A.elems.size())
-	{
-		for (int elem : B.elems)
-		{
-			if (!std::binary_search(A.elems.begin(), A.elems.end(), elem))
-			{
-				result.elems.push_back(elem);
-			}
-		}
+		gallop_difference(A.elems, 0, B.elems, 0, result.elems);
 		return result;
 	}
 	else
 	{
-		// default algorithm
-		size_t p = 0, q = 0;
-
-		while (p < A.elems.size() && q < B.elems.size())
-		{
-			if (A.elems[p] < B.elems[q])
-			{
-				result.elems.push_back(A.elems[p]);
-				++p;
-			}
-			else if (B.elems[q] < A.elems[p])
-			{
-				++q;
-			}
-			else
-			{
-				++p;
-				++q;
-			}
-		}
-
+		// a large b can't be searched into, merge instead
+		merge_difference(A.elems, 0, B.elems, 0, result.elems);
 		return result;
 	}
 }
@@ -602,70 +836,17 @@ ExplicitSet difference(const ExplicitSet &A, const ExplicitSet &B)
 ExplicitSet difference(const IndexSet &A, const IndexSet &B)
 {
 	// std::cout << "Funktion 11" << std::endl;
-	ExplicitSet result;
+	ExplicitSet result = scratch_set(A.elems.size());
 
 	if (A.elems.size() * SIZE_RATIO < B.elems.size())
 	{
-		for (int elem : A.elems)
-		{
-			// apply shifts
-			int shifted_elem = elem + A.shift;
-			int target = shifted_elem - B.shift;
-
-			if (!std::binary_search(B.elems.begin(), B.elems.end(), target))
-			{
-				result.elems.push_back(shifted_elem);
-			}
-		}
-		return result;
-	}
-	else if (B.elems.size() * SIZE_RATIO < A.elems.size())
-	{
-		for (int elem : B.elems)
-		{
-			// apply shifts
-			int shifted_elem = elem + B.shift;
-			int target = shifted_elem - A.shift;
-
-			if (!std::binary_search(A.elems.begin(), A.elems.end(), target))
-			{
-				result.elems.push_back(shifted_elem);
-			}
-		}
+		gallop_difference(A.elems, A.shift, B.elems, B.shift, result.elems);
 		return result;
 	}
 	else
 	{
-		size_t p = 0, q = 0;
-
-		while (p < A.elems.size() && q < B.elems.size())
-		{
-			// apply the shifts
-			int shifted_a_elem = A.elems[p] + A.shift;
-			int shifted_b_elem = B.elems[q] + B.shift;
-
-			if (shifted_a_elem < shifted_b_elem)
-			{
-				result.elems.push_back(shifted_a_elem);
-				++p;
-			}
-			else if (shifted_b_elem < shifted_a_elem)
-			{
-				++q;
-			}
-			else
-			{
-				++p;
-				++q;
-			}
-		}
-		// add the rest of A
-		while (p <= A.elems.size())
-		{
-			result.elems.push_back(A.elems[p]);
-			p++;
-		}
-
+		// a large b can't be searched into, merge instead
+		merge_difference(A.elems, A.shift, B.elems, B.shift, result.elems);
 		return result;
 	}
 }
@@ -673,53 +854,17 @@ ExplicitSet difference(const IndexSet &A, const IndexSet &B)
 ExplicitSet difference(const IndexSet &A, const ExplicitSet &B)
 {
 	// std::cout << "Funktion 12" << std::endl;
-	ExplicitSet result;
+	ExplicitSet result = scratch_set(A.elems.size());
 
 	if (A.elems.size() * SIZE_RATIO < B.elems.size())
 	{
-		for (int elem : A.elems)
-		{
-			int shifted_elem = elem + A.shift;
-			if (!std::binary_search(B.elems.begin(), B.elems.end(), shifted_elem))
-			{
-				result.elems.push_back(shifted_elem);
-			}
-		}
-		return result;
-	}
-	else if (B.elems.size() * SIZE_RATIO < A.elems.size())
-	{
-		for (int elem : B.elems)
-		{
-			if (!std::binary_search(A.elems.begin(), A.elems.end(), elem))
-			{
-				result.elems.push_back(elem);
-			}
-		}
+		gallop_difference(A.elems, A.shift, B.elems, 0, result.elems);
 		return result;
 	}
 	else
 	{
-		size_t p = 0, q = 0;
-
-		while (p < A.elems.size() && q < B.elems.size())
-		{
-			int shifted_a_elem = A.elems[p] + A.shift;
-			if (shifted_a_elem < B.elems[q])
-			{
-				result.elems.push_back(shifted_a_elem);
-				++p;
-			}
-			else if (B.elems[q] < shifted_a_elem)
-			{
-				++q;
-			}
-			else
-			{
-				++p;
-				++q;
-			}
-		}
+		// a large b can't be searched into, merge instead
+		merge_difference(A.elems, A.shift, B.elems, 0, result.elems);
 		return result;
 	}
 }
@@ -727,67 +872,17 @@ ExplicitSet difference(const IndexSet &A, const ExplicitSet &B)
 ExplicitSet difference(const ExplicitSet &A, const IndexSet &B)
 {
 	// std::cout << "Function 13" << std::endl;
-	ExplicitSet result;
+	ExplicitSet result = scratch_set(A.elems.size());
 
 	if (A.elems.size() * SIZE_RATIO < B.elems.size())
 	{
-		for (int elem : A.elems)
-		{
-			int target = elem - B.shift;
-			// add elem in not in B
-			if (!std::binary_search(B.elems.begin(), B.elems.end(), target))
-			{
-				result.elems.push_back(elem);
-			}
-		}
-		return result;
-	}
-	else if (B.elems.size() * SIZE_RATIO < A.elems.size())
-	{
-		for (int elem : B.elems)
-		{
-			int shifted_elem = elem + B.shift;
-			// add elem not in a
-			if (!std::binary_search(A.elems.begin(), A.elems.end(), shifted_elem))
-			{
-				result.elems.push_back(shifted_elem);
-			}
-		}
+		gallop_difference(A.elems, 0, B.elems, B.shift, result.elems);
 		return result;
 	}
 	else
 	{
-		size_t p = 0;
-		size_t q = 0;
-
-		while (p < A.elems.size() && q < B.elems.size())
-		{
-			int shifted_b_elem = B.elems[q] + B.shift;
-
-			if (A.elems[p] < shifted_b_elem)
-			{
-				// a is not in b, add to result
-				result.elems.push_back(A.elems[p]);
-				++p;
-			}
-			else if (shifted_b_elem < A.elems[p])
-			{
-				++q;
-			}
-			else
-			{
-				++p;
-				++q;
-			}
-		}
-
-		// add remaning from a
-		while (p < A.elems.size())
-		{
-			result.elems.push_back(A.elems[p]);
-			++p;
-		}
-
+		// a large b can't be searched into, merge instead
+		merge_difference(A.elems, 0, B.elems, B.shift, result.elems);
 		return result;
 	}
 }
@@ -815,13 +910,16 @@ DenseSet difference(const DenseSet &A, const DenseSet &B)
 ExplicitSet difference(const DenseSet &A, const ExplicitSet &B)
 {
 	// std::cout << "Funktion 15" << std::endl;
-	ExplicitSet C;
+	ExplicitSet C = scratch_set(std::max(A.last - A.first, 0));
 
 	if (B.elems.size() > static_cast<size_t>((A.last - A.first) * SIZE_RATIO))
 	{
+		const int *next = B.elems.data();
+		const int *end = B.elems.data() + B.elems.size();
 		for (int p = A.first; p < A.last; ++p)
 		{
-			if (!std::binary_search(B.elems.begin(), B.elems.end(), p))
+			next = gallop(next, end, p);
+			if (next == end || *next != p)
 			{
 				C.elems.push_back(p);
 			}
@@ -864,16 +962,19 @@ ExplicitSet difference(const DenseSet &A, const ExplicitSet &B)
 ExplicitSet difference(const DenseSet &A, const IndexSet &B)
 {
 	// std::cout << "Funktion 16" << std::endl;
-	ExplicitSet result;
+	ExplicitSet result = scratch_set(std::max(A.last - A.first, 0));
 	if (B.elems.size() > static_cast<size_t>((A.last - A.first) * SIZE_RATIO))
 	{
+		const int *next = B.elems.data();
+		const int *end = B.elems.data() + B.elems.size();
 		for (int p = A.first; p < A.last; ++p)
 		{
 			// Calculate the target in B with the shift applied
 			int target = p - B.shift;
 
-			// Use binary search on B.elems to see if p (shifted) is not in B
-			if (!std::binary_search(B.elems.begin(), B.elems.end(), target))
+			// search on from the previous target to see if p (shifted) is not in B
+			next = gallop(next, end, target);
+			if (next == end || *next != target)
 			{
 				result.elems.push_back(p);
 			}
@@ -906,7 +1007,7 @@ ExplicitSet difference(const DenseSet &A, const IndexSet &B)
 			}
 		}
 		// get the remaning elements
-		while (p <= A.last)
+		while (p < A.last)
 		{
 			result.elems.push_back(p);
 			++p;
@@ -919,7 +1020,7 @@ ExplicitSet difference(const DenseSet &A, const IndexSet &B)
 ExplicitSet difference(const ExplicitSet &B, const DenseSet &A)
 {
 	// std::cout << "Funktion 17" << std::endl;
-	ExplicitSet C;
+	ExplicitSet C = scratch_set(B.elems.size());
 	int p = 0;
 	int q = A.first;
 
@@ -953,7 +1054,7 @@ ExplicitSet difference(const ExplicitSet &B, const DenseSet &A)
 ExplicitSet difference(const IndexSet &B, const DenseSet &A)
 {
 	// std::cout << "Funktion 18" << std::endl;
-	ExplicitSet C;
+	ExplicitSet C = scratch_set(B.elems.size());
 	size_t p = 0;
 	size_t q = A.first;
 
@@ -990,11 +1091,26 @@ MatchSet match_set(const Corpus &corpus, const Literal &literal, int shift)
 {
 	MatchSet result;
 
-	const std::string &attribute = literal.attribute;
+	Attribute attribute = literal.attribute;
 	uint32_t value = literal.value;
-	// get the index set
-	IndexSet index_set = index_lookup(corpus, attribute, value);
-	index_set.shift = shift;
+	// get the index set, frequent values as a bitmap
+	if (std::optional<BitmapSet> bitmap = bitmap_lookup(corpus, attribute, value))
+	{
+		bitmap->shift = shift;
+		result.set = std::move(*bitmap);
+	}
+	else if (find_index(corpus, attribute)->is_compressed())
+	{
+		CompressedSet compressed_set = compressed_lookup(corpus, attribute, value);
+		compressed_set.shift = shift;
+		result.set = compressed_set;
+	}
+	else
+	{
+		IndexSet index_set = index_lookup(corpus, attribute, value);
+		index_set.shift = shift;
+		result.set = index_set;
+	}
 
 	if (!literal.is_equality)
 	{
@@ -1004,27 +1120,87 @@ MatchSet match_set(const Corpus &corpus, const Literal &literal, int shift)
 	{
 		result.complement = false;
 	}
-	result.set = index_set;
 
 	return result;
 }
 
-void match_set(const Corpus &corpus, const Clause &clause, int shift, std::vector<MatchSet> &sets, bool &dense_sets)
+VerifiedLiteral verified_literal(const Corpus &corpus, const Literal &literal, int offset)
+{
+	return VerifiedLiteral{find_column(corpus, literal.attribute), literal.value, offset, literal.is_equality};
+}
+
+void match_set(const Corpus &corpus, const Clause &clause, int shift, std::vector<MatchSet> &sets, bool &dense_sets, const std::vector<bool> &covered, std::vector<std::vector<VerifiedLiteral>> &sources)
 {
 
-	if (clause[0].attribute == "match all")
+	if (clause[0].attribute == Attribute::match_all)
 	{
 		// dense set appared
 		dense_sets = true;
 	}
 	else
 	{
-		MatchSet result;
-
-		for (const Literal &literal : clause)
+		for (size_t i = 0; i < clause.size(); i++)
 		{
-			MatchSet literalMatchSet = match_set(corpus, literal, shift);
+			if (covered[i])
+			{
+				// already part of a binary index set
+				continue;
+			}
+			MatchSet literalMatchSet = match_set(corpus, clause[i], shift);
 			sets.push_back(literalMatchSet);
+			sources.push_back({verified_literal(corpus, clause[i], -shift)});
+		}
+	}
+}
+
+// looks up adjacent clauses in the binary indexes. for every pair of
+// clauses the smallest binary set is used and the two literals it answers
+// are marked as covered
+void binary_match_sets(const Corpus &corpus, const Query &query, std::vector<MatchSet> &sets, std::vector<std::vector<bool>> &covered, std::vector<std::vector<VerifiedLiteral>> &sources)
+{
+	for (size_t i = 0; i + 1 < query.size(); i++)
+	{
+		const Clause &left = query[i];
+		const Clause &right = query[i + 1];
+		std::span<const int> best;
+		size_t best_left = 0, best_right = 0;
+		bool found = false;
+
+		for (const BinaryIndex &index : corpus.binary_indices)
+		{
+			for (size_t l = 0; l < left.size(); l++)
+			{
+				if (!left[l].is_equality || left[l].attribute != index.first)
+				{
+					continue;
+				}
+				for (size_t r = 0; r < right.size(); r++)
+				{
+					if (!right[r].is_equality || right[r].attribute != index.second)
+					{
+						continue;
+					}
+					std::span<const int> elems = index.lookup(left[l].value, right[r].value);
+					if (!found || elems.size() < best.size())
+					{
+						best = elems;
+						best_left = l;
+						best_right = r;
+						found = true;
+					}
+				}
+			}
+		}
+
+		if (found)
+		{
+			MatchSet pair_set;
+			pair_set.set = IndexSet{best, -static_cast<int>(i)};
+			pair_set.complement = false;
+			sets.push_back(pair_set);
+			sources.push_back({verified_literal(corpus, left[best_left], static_cast<int>(i)), verified_literal(corpus, right[best_right], static_cast<int>(i) + 1)});
+			covered[i][best_left] = true;
+			covered[i + 1][best_right] = true;
 		}
 	}
 }
@@ -1040,6 +1216,10 @@ size_t get_set_size(const MatchSet &set)
             return s.elems.size();
         } else if constexpr (std::is_same_v<T, ExplicitSet>) {
             return s.elems.size();
+        } else if constexpr (std::is_same_v<T, CompressedSet>) {
+            return s.size;
+        } else if constexpr (std::is_same_v<T, BitmapSet>) {
+            return s.size;
         } }, set.set);
 }
 
@@ -1050,118 +1230,296 @@ bool compare_size(const MatchSet &A, const MatchSet &B)
 	return size_A < size_B;
 }
 
-MatchSet match_set(const Corpus &corpus, const Query &query)
+// replaces the uncompressed posting lists among sets by their k-way
+// intersection, with the negated lists removed in the same pass. needs at
+// least one positive list, false if the sets are left as they are
+bool combine_posting_lists(std::vector<MatchSet> &sets)
 {
-	MatchSet result;
-	std::vector<MatchSet> sets;
-	bool dense_sets;
+	std::vector<IndexSet> lists;
+	std::vector<IndexSet> excluded;
+	for (const MatchSet &set : sets)
+	{
+		if (const IndexSet *list = std::get_if<IndexSet>(&set.set))
+		{
+			(set.complement ? excluded : lists).push_back(*list);
+		}
+	}
+	if (lists.empty() || lists.size() + excluded.size() < 2)
+	{
+		return false;
+	}
 
-	int shift = 0;
+	std::erase_if(sets, [](const MatchSet &set)
+				  { return std::holds_alternative<IndexSet>(set.set); });
+	MatchSet combined;
+	combined.set = kway_intersection(std::move(lists), excluded);
+	combined.complement = false;
+	sets.push_back(std::move(combined));
+	return true;
+}
 
-	for (const Clause &clause : query)
+// removes the starts of a result whose match would cross a sentence end.
+// explicit results are filtered in bulk with the sentence room column.
+// match2 walks a dense result sentence by sentence and checks posting
+// lists one by one
+MatchSet drop_cross_sentence(const Corpus &corpus, MatchSet result, int length)
+{
+	if (length <= 1 || length > MAX_ROOM || corpus.sentence_room.empty() || result.complement)
 	{
-		match_set(corpus, clause, shift, sets, dense_sets);
-		shift--;
+		// a complement result is checked when it is walked
+		return result;
 	}
-
-	if (!sets.empty())
+	if (ExplicitSet *starts = std::get_if<ExplicitSet>(&result.set))
 	{
+		filter_sentence_room(starts->elems, corpus.sentence_room, length);
+	}
+	return result;
+}
 
-		std::sort(sets.begin(), sets.end(), compare_size);
+std::vector<MatchSet> query_sets(const Corpus &corpus, const Query &query, bool &dense_sets)
+{
+	std::vector<std::vector<VerifiedLiteral>> sources;
+	return query_sets(corpus, query, dense_sets, sources);
+}
 
-		result = sets[0];
-		for (size_t i = 1; i < sets.size(); i++)
-		{
-			result = intersection(sets[i], result);
-		}
+std::vector<MatchSet> query_sets(const Corpus &corpus, const Query &query, bool &dense_sets, std::vector<std::vector<VerifiedLiteral>> &sources)
+{
+	std::vector<MatchSet> sets;
+	sources.clear();
+	dense_sets = false;
+
+	std::vector<std::vector<bool>> covered;
+	for (const Clause &clause : query)
+	{
+		covered.emplace_back(clause.size(), false);
 	}
+	binary_match_sets(corpus, query, sets, covered, sources);
+
+	int shift = 0;
 
-	if (dense_sets)
+	for (size_t i = 0; i < query.size(); i++)
 	{
-		// atleast one dense set
-		int size = corpus.tokens.size() - 1;
-		DenseSet empty_set{0, size};
-		MatchSet empty;
-		empty.set = empty_set;
-		empty.complement = false;
-		result = intersection(empty, result);
+		match_set(corpus, query[i], shift, sets, dense_sets, covered[i], sources);
+		shift--;
 	}
+	return sets;
+}
 
-	if (result.complement)
+// keeps the candidates of a positive result whose tokens pass every verified
+// literal, looked up on the columns at the shifted positions. the sentence
+// ends are checked first, a byte per candidate
+MatchSet verify_literals(const Corpus &corpus, MatchSet result, const std::vector<VerifiedLiteral> &verified, int length)
+{
+	// the candidates whose match ends inside the corpus
+	int last = static_cast<int>(corpus.size()) - length + 1;
+	ExplicitSet kept = scratch_set(get_set_size(result));
+	auto add = [&](int pos)
 	{
-		// we need to flip this
-		int size = corpus.tokens.size() - 1;
-		DenseSet empty_set{0, size};
-		MatchSet empty;
-		empty.set = empty_set;
-		empty.complement = false;
-		return intersection(empty, result);
+		if (pos >= 0 && pos < last)
+		{
+			kept.elems.push_back(pos);
+		}
+	};
+	for_each_position(result, add);
+	recycle(std::move(result));
+	result.set = std::move(kept);
+	result = drop_cross_sentence(corpus, std::move(result), length);
+
+	// one pass over the candidates per literal, the most selective first,
+	// with the test specialised for the width of its column. every
+	// candidate is written and kept by moving past it, without a branch
+	// that would be mispredicted for many of them
+	std::vector<int> &candidates = std::get<ExplicitSet>(result.set).elems;
+	for (const VerifiedLiteral &literal : verified)
+	{
+		with_literal_test(*literal.column, literal.value, literal.is_equality, [&](auto test)
+						  {
+			size_t kept = 0;
+			for (int pos : candidates)
+			{
+				candidates[kept] = pos;
+				kept += test(pos + literal.offset);
+			}
+			candidates.resize(kept); });
 	}
 	return result;
 }
 
-SentencePosition find_sentence_position_and_check(const Corpus &corpus, int pos, int matchLength)
+MatchSet match_set(const Corpus &corpus, const Query &query)
+{
+	return match_set(corpus, query, plan_query(corpus, query));
+}
+
+MatchSet match_set(const Corpus &corpus, const Query &query, const QueryPlan &plan)
 {
-	auto it = std::upper_bound(corpus.sentences.begin(), corpus.sentences.end(), pos);
-	if (it == corpus.sentences.begin())
+	MatchSet result;
+	std::vector<MatchSet> sets = plan.sets;
+
+	if (!sets.empty())
 	{
-		// match in first sentence
-		return {0, pos, pos + matchLength <= *it};
+		// the smallest positive set first, the negated sets are removed
+		// from it. the planner gives the sets in this order, only the
+		// combined posting lists have to be put in their place
+		if (combine_posting_lists(sets))
+		{
+			std::stable_sort(sets.begin(), sets.end(), compare_size);
+			std::stable_partition(sets.begin(), sets.end(), [](const MatchSet &set)
+								  { return !set.complement; });
+		}
+
+		// every intermediate result gives its buffer back for the next
+		result = std::move(sets[0]);
+		for (size_t i = 1; i < sets.size(); i++)
+		{
+			MatchSet next = intersection(sets[i], result);
+			recycle(std::move(result));
+			result = std::move(next);
+		}
 	}
-	if (it == corpus.sentences.end())
+
+	else
 	{
-		// match in last sentence
-		int sentence_index = corpus.sentences.size() - 1;
-		return {sentence_index, pos - corpus.sentences[sentence_index], true};
+		// only [] clauses, every token starts a candidate
+		result.set = DenseSet{0, static_cast<int>(corpus.size())};
+		result.complement = false;
 	}
-	// the index of the sentence
-	int sentence_index = std::distance(corpus.sentences.begin(), it) - 1;
-	// get pos in sentence
-	int position_in_sentence = pos - corpus.sentences[sentence_index];
-	bool in_same_sentence;
-	if (pos + matchLength <= *it)
+
+	// a complement result (only negated literals) is kept as the positions
+	// that do not match, set_matches walks around them
+	if (!plan.verified.empty())
 	{
-		in_same_sentence = true;
+		return verify_literals(corpus, std::move(result), plan.verified, query.size());
 	}
-	else
+	return drop_cross_sentence(corpus, result, query.size());
+}
+
+SentenceSweep::SentenceSweep(const Corpus &corpus) : corpus(&corpus)
+{
+	start = 0;
+	end = corpus.sentences.size() > 1 ? corpus.sentences[1] : static_cast<int>(corpus.size());
+}
+
+void SentenceSweep::seek(int pos)
+{
+	if (pos < end)
 	{
-		in_same_sentence = false;
+		return;
 	}
-	return {sentence_index, position_in_sentence, in_same_sentence};
+	// usually the next sentence or one close by, gallop from there
+	const Array<int> &sentences = corpus->sentences;
+	sentence = gallop(sentences.data() + sentence + 1, sentences.end(), pos + 1) - sentences.data() - 1;
+	start = sentences[sentence];
+	end = sentence + 1 < sentences.size() ? sentences[sentence + 1] : static_cast<int>(corpus->size());
 }
 
 std::vector<Match> match2(const Corpus &corpus, const Query &query)
 {
-	MatchSet matchSet = match_set(corpus, query);
+	return match_sharded(corpus, query, plan_query(corpus, query));
+}
+
+std::vector<Match> set_matches(const Corpus &corpus, const MatchSet &matchSet, int matchLenght)
+{
+	return set_matches(corpus, matchSet, matchLenght, 0, static_cast<int>(corpus.size()));
+}
+
+std::vector<Match> set_matches(const Corpus &corpus, const MatchSet &matchSet, int matchLenght, int first, int last)
+{
+	// every position of the range or of the set starts at most one match
 	std::vector<Match> matches;
-	int matchLenght = query.size();
+	size_t starts = std::max(last - first, 0);
+	matches.reserve(matchSet.complement ? starts : std::min(starts, get_set_size(matchSet)));
+	// the positions of every set come in increasing order, so they are
+	// mapped to sentences in one sweep
+	SentenceSweep sweep(corpus);
+	auto add_match = [&](int pos)
+	{
+		if (pos < first || pos >= last)
+		{
+			return;
+		}
+		sweep.seek(pos);
+		if (pos + matchLenght <= sweep.end)
+		{
+			matches.push_back(Match{static_cast<int>(sweep.sentence), pos - sweep.start, matchLenght});
+		}
+	};
+	if (matchSet.complement)
+	{
+		// every start that fits in its sentence, except the positions of the
+		// set, which a cursor passes over in the same order
+		// (a bitmap is read 64 positions at a time instead)
+		const BitmapSet *bitmap = std::get_if<BitmapSet>(&matchSet.set);
+		SetCursor excluded = make_cursor(matchSet);
+		int next_excluded = bitmap ? END_POSITION : cursor_seek(excluded, first);
+		const Array<int> &sentences = corpus.sentences;
+		size_t i = std::upper_bound(sentences.begin(), sentences.end(), first) - sentences.begin();
+		for (i = i > 0 ? i - 1 : 0; i < sentences.size() && sentences[i] < last; i++)
+		{
+			int start = sentences[i];
+			int end = i + 1 < sentences.size() ? sentences[i + 1] : static_cast<int>(corpus.size());
+			int from = std::max(start, first);
+			int to = std::min(end - matchLenght + 1, last);
+			if (bitmap)
+			{
+				for (int word_first = from; word_first < to; word_first += 64)
+				{
+					uint64_t free = ~bitmap_word(*bitmap, word_first) & low_bits(to - word_first);
+					while (free != 0)
+					{
+						int pos = word_first + std::countr_zero(free);
+						free &= free - 1;
+						matches.push_back(Match{static_cast<int>(i), pos - start, matchLenght});
+					}
+				}
+				continue;
+			}
+			for (int pos = from; pos < to; pos++)
+			{
+				if (next_excluded < pos)
+				{
+					next_excluded = cursor_seek(excluded, pos);
+				}
+				if (next_excluded != pos)
+				{
+					matches.push_back(Match{static_cast<int>(i), pos - start, matchLenght});
+				}
+			}
+		}
+		return matches;
+	}
 	std::visit([&](auto &&set)
 			   {
         using T = std::decay_t<decltype(set)>;
 
         if constexpr (std::is_same_v<T, DenseSet>) {
-          	for (int pos = set.first; pos < set.last; ++pos) {
-                auto result = find_sentence_position_and_check(corpus, pos, matchLenght);
-                if (result.is_valid) {
-                    matches.push_back(Match{result.sentence_index, result.position_in_sentence, matchLenght});
+            // the starts that fit in a sentence are its first
+            // length - matchLenght + 1 tokens
+            int set_last = std::min(set.last, last);
+            for (int pos = std::max(set.first, first); pos < set_last; ) {
+                sweep.seek(pos);
+                int sentence_last = std::min(set_last, sweep.end - matchLenght + 1);
+                for (; pos < sentence_last; ++pos) {
+                    matches.push_back(Match{static_cast<int>(sweep.sentence), pos - sweep.start, matchLenght});
                 }
+                pos = std::max(pos, sweep.end);
             }
 
         } else if constexpr (std::is_same_v<T, IndexSet>) {
             for (int pos : set.elems) {
-                int shifted_pos = pos + set.shift;
-                auto result = find_sentence_position_and_check(corpus, shifted_pos, matchLenght);
-                if (result.is_valid) {
-                    matches.push_back(Match{result.sentence_index, result.position_in_sentence, matchLenght});
-                }
+                add_match(pos + set.shift);
             }
         } else if constexpr (std::is_same_v<T, ExplicitSet>) {
             for (int pos : set.elems) {
-                auto result = find_sentence_position_and_check(corpus, pos, matchLenght);
-                if (result.is_valid) {
-                    matches.push_back(Match{result.sentence_index, result.position_in_sentence, matchLenght});
-                }
+                add_match(pos);
             }
+        } else if constexpr (std::is_same_v<T, CompressedSet>) {
+            for_each_block(set, [&](std::span<const int> block) {
+                for (int pos : block) {
+                    add_match(pos + set.shift);
+                }
+            });
+        } else if constexpr (std::is_same_v<T, BitmapSet>) {
+            for_each_bit(set, add_match);
         } }, matchSet.set);
 
 	return matches;
@@ -2,36 +2,275 @@
 #define CORPUS_H
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
 #include <span>
 #include <iterator>
 #include <variant>
+#include <memory>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
-struct Token
+// read-only array that either owns its elements or views memory owned by
+// someone else (e.g. a memory mapped snapshot kept alive through owner)
+template <typename T>
+class Array
 {
-	uint32_t word;
-	uint32_t c5;
-	uint32_t lemma;
-	uint32_t pos;
+public:
+	using value_type = T;
+
+	Array() = default;
+	Array(std::vector<T> &&values)
+	{
+		auto storage = std::make_shared<std::vector<T>>(std::move(values));
+		elems = std::span<const T>(storage->data(), storage->size());
+		owner = std::move(storage);
+	}
+	Array(std::span<const T> view, std::shared_ptr<const void> keep_alive)
+		: elems(view), owner(std::move(keep_alive)) {}
+
+	const T &operator[](size_t i) const { return elems[i]; }
+	const T *data() const { return elems.data(); }
+	const T *begin() const { return elems.data(); }
+	const T *end() const { return elems.data() + elems.size(); }
+	const T &back() const { return elems.back(); }
+	size_t size() const { return elems.size(); }
+	bool empty() const { return elems.empty(); }
+	std::span<const T> span() const { return elems; }
+
+private:
+	std::span<const T> elems;
+	std::shared_ptr<const void> owner;
+};
+
+// all strings concatenated, string i is chars[offsets[i]..offsets[i + 1])
+struct StringTable
+{
+	Array<char> chars;
+	Array<uint32_t> offsets;
+
+	std::string_view operator[](size_t i) const
+	{
+		return std::string_view(chars.data() + offsets[i], offsets[i + 1] - offsets[i]);
+	}
+	size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+};
+
+// id returned for strings that are not in a vocabulary
+const uint32_t NO_ID = -1;
+
+// the distinct values of one attribute, ids are dense and given in order of
+// first occurrence. lookups go through an open addressing hash table
+// (linear probing, power of two size) that stores ids into strings
+struct Vocabulary
+{
+	StringTable strings;
+	Array<uint32_t> slots; // NO_ID marks an empty slot
+
+	uint32_t find(std::string_view str) const;
+	std::string_view operator[](size_t id) const { return strings[id]; }
+	size_t size() const { return strings.size(); }
+};
+
+// growable vocabulary used while loading
+class VocabularyBuilder
+{
+public:
+	VocabularyBuilder();
+	uint32_t intern(std::string_view str);
+	std::string_view operator[](size_t id) const;
+	size_t size() const { return offsets.size() - 1; }
+	Vocabulary finish();
+
+private:
+	void grow();
+
+	std::vector<char> chars;
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> slots;
 };
+
+// one attribute of every token, stored in the narrowest unsigned type that
+// holds all ids of the attribute's vocabulary
+struct Column
+{
+	std::variant<Array<uint8_t>, Array<uint16_t>, Array<uint32_t>> values;
+
+	uint32_t operator[](size_t pos) const
+	{
+		if (auto *narrow = std::get_if<Array<uint8_t>>(&values))
+		{
+			return (*narrow)[pos];
+		}
+		if (auto *medium = std::get_if<Array<uint16_t>>(&values))
+		{
+			return (*medium)[pos];
+		}
+		return std::get<Array<uint32_t>>(values)[pos];
+	}
+	size_t size() const
+	{
+		return std::visit([](const auto &array)
+						  { return array.size(); }, values);
+	}
+};
+// the token attributes a literal can test. match_all is the literal of
+// the empty clause, which every token matches
+enum class Attribute
+{
+	word,
+	c5,
+	lemma,
+	pos,
+	match_all,
+};
+
+// a literal tested on a column with values of type T, for either
+// comparison. loops over positions are instantiated per column width and
+// comparison, so the dispatch happens once per literal (see
+// with_literal_test)
+template <typename T, bool Equality>
+struct LiteralTest
+{
+	const T *values;
+	uint32_t value;
+
+	bool operator()(size_t pos) const { return (values[pos] == value) == Equality; }
+};
+
+// calls f with the LiteralTest for the width of the column
+template <typename F>
+void with_literal_test(const Column &column, uint32_t value, bool is_equality, F &&f)
+{
+	std::visit([&](const auto &array)
+			   {
+		using T = typename std::decay_t<decltype(array)>::value_type;
+		if (is_equality)
+		{
+			f(LiteralTest<T, true>{array.data(), value});
+		}
+		else
+		{
+			f(LiteralTest<T, false>{array.data(), value});
+		} }, column.values);
+}
+
 struct Literal
 {
-	std::string attribute; // left-hand side
+	Attribute attribute;   // left-hand side
 	uint32_t value;		   // right-hand side
 	bool is_equality;	   // true if = and false if !=
 };
-using Index = std::vector<int>;
+// posting lists cut into blocks of POSTING_BLOCK_SIZE positions. a full
+// block stores the differences to the position four entries earlier,
+// bit-packed in four interleaved lanes so a block decodes with 128-bit
+// vector operations. the shorter last block of a list is stored as is
+// (see postings.cpp)
+const size_t POSTING_BLOCK_SIZE = 128;
+const uint8_t RAW_BLOCK = 0xff;
+
+struct CompressedPostings
+{
+	Array<uint32_t> value_blocks; // blocks of value v are value_blocks[v]..value_blocks[v + 1]
+	Array<int> block_first;		  // skip table: first and last position of every block
+	Array<int> block_last;
+	Array<uint8_t> block_bits;	 // width of the packed differences, RAW_BLOCK if stored as is
+	Array<uint32_t> block_data; // block b is data[block_data[b]..block_data[b + 1])
+	Array<uint32_t> data;
+
+	bool empty() const { return value_blocks.empty(); }
+	// writes the positions of a block to out (room for POSTING_BLOCK_SIZE)
+	// and returns how many there are
+	size_t decode(uint32_t block, int *out) const;
+};
+
+// a value on at least 1/BITMAP_DENSITY of the tokens also gets a bitmap
+// of its positions, which is then no larger than its posting list
+const size_t BITMAP_DENSITY = 32;
+
+inline size_t bitmap_words(size_t bits) { return (bits + 63) / 64; }
+
+// positions of every token sorted by value, the positions with value v are
+// positions[offsets[v]..offsets[v + 1]). a compressed index keeps only the
+// offsets and the compressed postings. bitmap s of the frequent values is
+// the bitmap_words(corpus size) words from s * bitmap_words(corpus size)
+// in bitmaps, bitmap_slots gives the s of every value (NO_ID if none)
+struct Index
+{
+	Array<int> positions;
+	Array<uint32_t> offsets;
+	CompressedPostings compressed;
+	Array<uint32_t> bitmap_slots;
+	Array<uint64_t> bitmaps;
+
+	bool is_compressed() const { return !compressed.empty(); }
+	std::span<const int> lookup(uint32_t value) const
+	{
+		if (offsets.empty() || value >= offsets.size() - 1 || is_compressed())
+		{
+			// also covers NO_ID
+			return {};
+		}
+		return positions.span().subspan(offsets[value], offsets[value + 1] - offsets[value]);
+	}
+	size_t count(uint32_t value) const
+	{
+		if (offsets.empty() || value >= offsets.size() - 1)
+		{
+			return 0;
+		}
+		return offsets[value + 1] - offsets[value];
+	}
+};
+// index over adjacent token pairs: positions p whose token has value a for
+// attribute first and whose next token (in the same sentence) has value b
+// for attribute second. positions are sorted by (a, b, p), the entries with
+// first value a are positions[offsets[a]..offsets[a + 1]) and seconds holds
+// the b of every entry
+struct BinaryIndex
+{
+	Attribute first;
+	Attribute second;
+	Array<int> positions;
+	Array<uint32_t> offsets;
+	Array<uint32_t> seconds;
+
+	std::span<const int> lookup(uint32_t first_value, uint32_t second_value) const;
+};
+
+// the sentence room of a token is how many tokens from it on are in its
+// sentence, at most MAX_ROOM. a match of length n can start at a token if
+// its room is at least n. the room column has ROOM_PADDING zero bytes at
+// the end so it can be read four bytes at a time
+const int MAX_ROOM = 255;
+const size_t ROOM_PADDING = 3;
+
 struct Corpus
 {
-	std::vector<Token> tokens;
-	std::vector<int> sentences;
-	std::vector<std::string> index2string;
-	std::map<std::string, uint32_t> string2index;
+	Column word_column;
+	Column c5_column;
+	Column lemma_column;
+	Column pos_column;
+	Array<int> sentences;
+	Vocabulary word_vocab;
+	Vocabulary c5_vocab;
+	Vocabulary lemma_vocab;
+	Vocabulary pos_vocab;
 	Index word_index;  // NEW
 	Index c5_index;	   // NEW
 	Index lemma_index; // NEW
 	Index pos_index;   // NEW
+	std::vector<BinaryIndex> binary_indices;
+	Array<uint8_t> sentence_room;
+
+	size_t size() const { return word_column.size(); }
 };
 using Clause = std::vector<Literal>;
 using Query = std::vector<Clause>;
@@ -52,9 +291,28 @@ struct ExplicitSet
 	std::vector<int> elems;
 };
 
+// the blocks [first_block, last_block) of a compressed posting list
+struct CompressedSet
+{
+	const CompressedPostings *postings;
+	uint32_t first_block;
+	uint32_t last_block;
+	size_t size;
+	int shift;
+};
+
+// bit i of words is position i + shift. bitmaps of frequent values view
+// their index, the results of bitmap operations own their words
+struct BitmapSet
+{
+	Array<uint64_t> words;
+	int shift;
+	size_t size; // set bits
+};
+
 struct MatchSet
 {
-	std::variant<DenseSet, IndexSet, ExplicitSet> set;
+	std::variant<DenseSet, IndexSet, ExplicitSet, CompressedSet, BitmapSet> set;
 	bool complement;
 };
 
@@ -64,21 +322,46 @@ struct Match
 	int pos;
 	int len;
 };
-struct SentencePosition
+// maps positions given in increasing order to their sentences with one
+// forward sweep over the sentence starts
+struct SentenceSweep
 {
-	int sentence_index;
-	int position_in_sentence;
-	bool is_valid;
+	explicit SentenceSweep(const Corpus &corpus);
+	// moves to the sentence of pos, which can't be before the previous one
+	void seek(int pos);
+
+	size_t sentence = 0;
+	int start; // first token of the sentence
+	int end;   // one past its last token
+
+private:
+	const Corpus *corpus;
 };
 
 Corpus load_corpus(const std::string &filename);
+// the attribute of a name in a query or an option, none if it is unknown
+std::optional<Attribute> find_attribute(std::string_view name);
+std::string_view attribute_name(Attribute attribute);
+const Vocabulary *find_vocabulary(const Corpus &corpus, Attribute attribute);
+const Column *find_column(const Corpus &corpus, Attribute attribute);
 std::vector<Match> match(const Corpus &corpus, const std::string &query_string);
 Query parse_query(const std::string &text, const Corpus &corpus);
 std::vector<Match> match(const Corpus &corpus, const Query &query);
 void print_matches(const Corpus &corpus, const std::vector<Match> &matches);
-Index build_index(const std::vector<Token> &tokens, uint32_t Token::*attribute);
-void build_indices(Corpus &corpus);
-IndexSet index_lookup(const Corpus &corpus, const std::string &attribute, uint32_t value);
+Index build_index(const Column &column, size_t vocab_size);
+BinaryIndex build_binary_index(const Corpus &corpus, const std::string &first, const std::string &second);
+CompressedPostings compress_postings(const Index &index);
+Array<uint8_t> build_sentence_room(const Corpus &corpus);
+extern const std::vector<std::pair<std::string, std::string>> DEFAULT_BINARY_INDICES;
+struct IndexOptions
+{
+	std::vector<std::pair<std::string, std::string>> binary_indices = DEFAULT_BINARY_INDICES;
+	bool compress_postings = false;
+};
+void build_indices(Corpus &corpus, const IndexOptions &options = IndexOptions());
+const Index *find_index(const Corpus &corpus, Attribute attribute);
+IndexSet index_lookup(const Corpus &corpus, Attribute attribute, uint32_t value);
+CompressedSet compressed_lookup(const Corpus &corpus, Attribute attribute, uint32_t value);
 std::vector<Match> match_single(const Corpus &corpus, const std::string &attr, const std::string &value);
 MatchSet intersection(const MatchSet &A, const MatchSet &B);
 // helper functions
@@ -105,7 +388,550 @@ ExplicitSet difference(const ExplicitSet &A, const IndexSet &B);
 ExplicitSet difference(const IndexSet &A, const ExplicitSet &B);
 ExplicitSet difference(const IndexSet &A, const IndexSet &B);
 
+// append the shifted elements of a that are (not) in the shifted b, using
+// the widest SIMD kernel the cpu supports (see merge.cpp)
+void merge_intersection(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out);
+void merge_difference(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out);
+// the same for a much smaller than b: every element of a is searched in b
+// from where the previous search ended
+void gallop_intersection(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out);
+void gallop_difference(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out);
+// first element of [begin, end) not less than target, probing 1, 2, 4, ...
+// elements ahead before a binary search
+const int *gallop(const int *begin, const int *end, int target);
+// the index of the first element of a sorted list whose shifted value is
+// not less than target
+size_t list_bound(std::span<const int> elems, int shift, int target);
+// the shifted elements in all lists and in none of excluded, in one pass
+ExplicitSet kway_intersection(std::vector<IndexSet> lists, const std::vector<IndexSet> &excluded);
+// keep the positions from which a match of length tokens stays in its
+// sentence, according to the sentence room column
+void filter_sentence_room(std::vector<int> &positions, const Array<uint8_t> &room, int length);
+
+// compressed sets, implemented in postings.cpp
+ExplicitSet intersection(const CompressedSet &A, const DenseSet &B);
+ExplicitSet intersection(const CompressedSet &A, const IndexSet &B);
+ExplicitSet intersection(const CompressedSet &A, const ExplicitSet &B);
+ExplicitSet intersection(const CompressedSet &A, const CompressedSet &B);
+ExplicitSet intersection(const DenseSet &B, const CompressedSet &A);
+ExplicitSet intersection(const IndexSet &B, const CompressedSet &A);
+ExplicitSet intersection(const ExplicitSet &B, const CompressedSet &A);
+
+ExplicitSet difference(const CompressedSet &A, const DenseSet &B);
+ExplicitSet difference(const CompressedSet &A, const IndexSet &B);
+ExplicitSet difference(const CompressedSet &A, const ExplicitSet &B);
+ExplicitSet difference(const CompressedSet &A, const CompressedSet &B);
+ExplicitSet difference(const DenseSet &A, const CompressedSet &B);
+ExplicitSet difference(const IndexSet &A, const CompressedSet &B);
+ExplicitSet difference(const ExplicitSet &A, const CompressedSet &B);
+
+// calls f with the (unshifted) positions of every block of the set in order
+template <typename F>
+void for_each_block(const CompressedSet &set, F &&f)
+{
+	int block[POSTING_BLOCK_SIZE];
+	for (uint32_t b = set.first_block; b < set.last_block; b++)
+	{
+		size_t count = set.postings->decode(b, block);
+		f(std::span<const int>(block, count));
+	}
+}
+
+// bitmap sets, implemented in bitmap.cpp. operations between bitmaps or
+// with a dense set are done a word at a time and give bitmaps, a list is
+// checked against a bitmap bit by bit
+void build_bitmaps(Index &index, const Column &column);
+// the bitmap of a value, if it is frequent enough to have one
+std::optional<BitmapSet> bitmap_lookup(const Corpus &corpus, Attribute attribute, uint32_t value);
+bool test_bit(const BitmapSet &set, int pos);
+// the bits of positions [first, first + 64) of a set, zero outside of it
+uint64_t bitmap_word(const BitmapSet &set, int64_t first);
+// a word with the lowest count bits set
+uint64_t low_bits(int64_t count);
+
+BitmapSet intersection(const BitmapSet &A, const BitmapSet &B);
+BitmapSet intersection(const BitmapSet &A, const DenseSet &B);
+BitmapSet intersection(const DenseSet &A, const BitmapSet &B);
+ExplicitSet intersection(const BitmapSet &A, const IndexSet &B);
+ExplicitSet intersection(const BitmapSet &A, const ExplicitSet &B);
+ExplicitSet intersection(const BitmapSet &A, const CompressedSet &B);
+ExplicitSet intersection(const IndexSet &A, const BitmapSet &B);
+ExplicitSet intersection(const ExplicitSet &A, const BitmapSet &B);
+ExplicitSet intersection(const CompressedSet &A, const BitmapSet &B);
+
+BitmapSet difference(const BitmapSet &A, const BitmapSet &B);
+BitmapSet difference(const BitmapSet &A, const DenseSet &B);
+BitmapSet difference(const DenseSet &A, const BitmapSet &B);
+BitmapSet difference(const BitmapSet &A, const IndexSet &B);
+BitmapSet difference(const BitmapSet &A, const ExplicitSet &B);
+BitmapSet difference(const BitmapSet &A, const CompressedSet &B);
+ExplicitSet difference(const IndexSet &A, const BitmapSet &B);
+ExplicitSet difference(const ExplicitSet &A, const BitmapSet &B);
+ExplicitSet difference(const CompressedSet &A, const BitmapSet &B);
+
+// calls f with the (shifted) positions of the set in order
+template <typename F>
+void for_each_bit(const BitmapSet &set, F &&f)
+{
+	for (size_t w = 0; w < set.words.size(); w++)
+	{
+		uint64_t word = set.words[w];
+		while (word != 0)
+		{
+			f(static_cast<int>(w * 64 + std::countr_zero(word)) + set.shift);
+			word &= word - 1;
+		}
+	}
+}
+
+// calls f with the (shifted) positions of a set in increasing order
+template <typename F>
+void for_each_position(const DenseSet &set, F &&f)
+{
+	for (int pos = set.first; pos < set.last; pos++)
+	{
+		f(pos);
+	}
+}
+
+template <typename F>
+void for_each_position(const IndexSet &set, F &&f)
+{
+	for (int elem : set.elems)
+	{
+		f(elem + set.shift);
+	}
+}
+
+template <typename F>
+void for_each_position(const ExplicitSet &set, F &&f)
+{
+	for (int elem : set.elems)
+	{
+		f(elem);
+	}
+}
+
+template <typename F>
+void for_each_position(const CompressedSet &set, F &&f)
+{
+	for_each_block(set, [&](std::span<const int> block)
+				   {
+		for (int elem : block)
+		{
+			f(elem + set.shift);
+		} });
+}
+
+template <typename F>
+void for_each_position(const BitmapSet &set, F &&f)
+{
+	for_each_bit(set, f);
+}
+
+// the positions of the set itself, regardless of complement
+template <typename F>
+void for_each_position(const MatchSet &set, F &&f)
+{
+	std::visit([&](const auto &s)
+			   { for_each_position(s, f); }, set.set);
+}
+
+// the positions in either set (regardless of complement): a bitmap if one
+// of them is, else a list
+BitmapSet bitmap_union(const MatchSet &A, const MatchSet &B);
+MatchSet union_sets(const MatchSet &A, const MatchSet &B);
+
 size_t get_set_size(const MatchSet &set);
+
+// the position lists of intermediate sets are taken from a pool of the
+// thread, reserved for the most elements the result can have, and given
+// back once the set is no longer needed (see scratch.cpp). the pool keeps
+// at most SCRATCH_BUFFERS buffers of SCRATCH_BYTES in all
+const size_t SCRATCH_BUFFERS = 16;
+const size_t SCRATCH_BYTES = 64 << 20;
+
+std::vector<int> scratch_positions(size_t capacity);
+ExplicitSet scratch_set(size_t capacity);
+void recycle(std::vector<int> &&buffer);
+// gives back the list of an explicit set
+void recycle(MatchSet &&set);
+// a literal checked on its column for every candidate instead of
+// intersecting the result with its set
+struct VerifiedLiteral
+{
+	const Column *column;
+	uint32_t value;
+	int offset; // clause of the literal
+	bool is_equality;
+};
+
+// the sets of all literals of a query, shifted to the query start. adjacent
+// clauses are answered by binary indexes where possible, dense_sets tells
+// if some clause matches every token
+std::vector<MatchSet> query_sets(const Corpus &corpus, const Query &query, bool &dense_sets);
+// the same, sources[k] are the literals set k answers (two for a binary
+// index set), as they would be checked on the columns
+std::vector<MatchSet> query_sets(const Corpus &corpus, const Query &query, bool &dense_sets, std::vector<std::vector<VerifiedLiteral>> &sources);
 std::vector<Match> match2(const Corpus &corpus, const Query &query);
 
+// a query compiled for the scan engine: every literal reads its column at
+// the offset of its clause and compares the value id. starts are checked
+// SCAN_BLOCK at a time (see scan.cpp)
+const int SCAN_BLOCK = 64;
+
+struct ScanLiteral
+{
+	const Column *column;
+	int offset;
+	uint32_t value;
+	bool negated;
+};
+
+struct ScanProgram
+{
+	std::vector<ScanLiteral> literals; // most selective first
+	int length = 0;
+	bool never = false; // a literal no token matches
+};
+
+ScanProgram compile_scan(const Corpus &corpus, const Query &query);
+std::vector<Match> run_scan(const Corpus &corpus, const ScanProgram &program);
+// the matches starting in [first, last)
+std::vector<Match> run_scan(const Corpus &corpus, const ScanProgram &program, int first, int last);
+
+// how a query is run, chosen by plan_query from the posting list lengths
+// (see planner.cpp)
+enum class Engine
+{
+	scan,  // check every position against the query (match)
+	index, // intersect the literal sets (match2)
+};
+
+struct QueryPlan
+{
+	Engine engine = Engine::index;
+	std::vector<MatchSet> sets; // intersected in this order
+	std::vector<VerifiedLiteral> verified; // checked in this order
+	ScanProgram program; // the compiled query, for the scan engine
+	double scan_cost = 0;
+	double index_cost = 0;
+};
+
+QueryPlan plan_query(const Corpus &corpus, const Query &query);
+// the same from sets of the query found otherwise, with the literals each
+// of them answers (see query_sets)
+QueryPlan plan_query(const Corpus &corpus, const Query &query, const std::vector<MatchSet> &sets, const std::vector<std::vector<VerifiedLiteral>> &sources);
+std::string describe_plan(const QueryPlan &plan);
+// the index engine following a plan
+MatchSet match_set(const Corpus &corpus, const Query &query, const QueryPlan &plan);
+MatchSet match_set(const Corpus &corpus, const Literal &literal, int shift);
+// the matches starting at the positions of a set
+std::vector<Match> set_matches(const Corpus &corpus, const MatchSet &set, int length);
+// only those starting in [first, last)
+std::vector<Match> set_matches(const Corpus &corpus, const MatchSet &set, int length, int first, int last);
+
+// match2 splits the corpus into shards of whole sentences that are run on
+// a pool of worker threads (see shard.cpp). a shard has at least
+// MIN_SHARD_TOKENS tokens, there are up to SHARDS_PER_THREAD per thread
+const size_t MIN_SHARD_TOKENS = 1 << 16;
+const size_t SHARDS_PER_THREAD = 4;
+// queries the planner expects to be faster (in ns) run on the calling thread
+const double MIN_SHARDED_COST = 250000;
+
+// runs task(0) .. task(count - 1) on the worker threads and the calling
+// one, returns when all are done
+void run_tasks(size_t count, const std::function<void(size_t)> &task);
+size_t worker_threads();
+// the shard starts, followed by the corpus size
+std::vector<int> shard_bounds(const Corpus &corpus);
+// the positions of a set starting a match in [first, last), plus a few
+// beyond them for bitmaps and compressed lists
+MatchSet slice_set(const MatchSet &set, int first, int last);
+// a query planned by plan_query, run on every shard
+std::vector<Match> match_sharded(const Corpus &corpus, const Query &query, const QueryPlan &plan);
+
+// cursors walk the positions of a set in increasing order without
+// materialising it, seeking skips ahead without looking at the positions
+// in between (see cursor.cpp)
+const int END_POSITION = std::numeric_limits<int>::max();
+
+struct RangeCursor
+{
+	int next;
+	int last;
+};
+
+struct ListCursor
+{
+	const int *next;
+	const int *end;
+	int shift;
+};
+
+struct BlockCursor
+{
+	const CompressedPostings *postings;
+	uint32_t block; // the decoded block, if count > 0
+	uint32_t last_block;
+	int shift;
+	size_t index;
+	size_t count;
+	int positions[POSTING_BLOCK_SIZE];
+};
+
+struct BitmapCursor
+{
+	const uint64_t *words;
+	size_t count; // words
+	int shift;
+};
+
+using SetCursor = std::variant<RangeCursor, ListCursor, BlockCursor, BitmapCursor>;
+
+// an ExplicitSet has to outlive its cursor
+SetCursor make_cursor(const MatchSet &set);
+// moves to the first position >= target and returns it, END_POSITION once
+// the set is exhausted. a cursor never moves backwards
+int cursor_seek(SetCursor &cursor, int target);
+
+// a cursor with a deadline looks at the clock once per DEADLINE_STEPS
+// seeks of its sets
+const int DEADLINE_STEPS = 4096;
+
+// the matches of a query, found one at a time when asked for, so the
+// first matches of a frequent pattern come without walking all of them
+class MatchCursor
+{
+public:
+	MatchCursor(const Corpus &corpus, const Query &query);
+	// the matches of a planned query: the cursors walk the sets of the
+	// plan, which has to outlive the cursor, and its verified literals are
+	// checked on the columns
+	MatchCursor(const Corpus &corpus, const Query &query, const QueryPlan &plan);
+	MatchCursor(const MatchCursor &) = delete;
+	MatchCursor &operator=(const MatchCursor &) = delete;
+	// moves to the next match without building it, false once there are
+	// no more matches or the deadline has passed
+	bool advance();
+	// the match advance stopped at
+	Match current() const;
+	bool next(Match &match);
+	// skips up to count matches and returns how many there were
+	size_t skip(size_t count);
+	// stops the walk once the deadline passes, even between two matches
+	void set_deadline(std::chrono::steady_clock::time_point time) { deadline = time; }
+	// advance stopped at the deadline, not at the last match
+	bool timed_out() const { return expired; }
+
+private:
+	int align(int target);
+
+	const Corpus *corpus;
+	int length;
+	std::vector<MatchSet> sets; // what the cursors walk
+	std::vector<SetCursor> include;
+	std::vector<SetCursor> exclude;
+	std::vector<VerifiedLiteral> verified;
+	int target = 0;
+	int position = 0;
+	SentenceSweep sweep;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	int steps = DEADLINE_STEPS; // until the clock is looked at
+	bool expired = false;
+};
+bool print_matches(const Corpus &corpus, MatchCursor &cursor, std::vector<Match> &matches, size_t keep);
+
+// the matches offset..offset + limit of a query, in corpus order
+std::vector<Match> match_range(const Corpus &corpus, const Query &query, size_t offset, size_t limit);
+// how many matches a query has. no Match is built, a single literal is
+// counted from its posting list length and a query of only [] clauses from
+// the sentence lengths
+size_t count_matches(const Corpus &corpus, const Query &query);
+// the same, counting only until the deadline. timeout tells if it passed,
+// the count is then the matches found before
+size_t count_matches(const Corpus &corpus, const Query &query, std::chrono::steady_clock::time_point deadline, bool &timeout);
+
+// a query parsed, resolved and planned once, to be run many times (see
+// prepared.cpp). a value written ? in the query text is a parameter, which
+// is given a value each time the query is run
+struct QueryParameter
+{
+	size_t clause;
+	size_t literal;
+};
+
+struct PreparedQuery
+{
+	Query query; // the literals of the parameters hold NO_ID
+	std::vector<QueryParameter> parameters; // in the order of the text
+	// the sets of the literals that are not parameters, with the literals
+	// each of them answers (see query_sets), if the query has parameters
+	std::vector<MatchSet> sets;
+	std::vector<std::vector<VerifiedLiteral>> sources;
+	QueryPlan plan; // of the query, if it has no parameters
+};
+
+// parse_query, with ? values allowed and listed in parameters
+Query parse_query(const std::string &text, const Corpus &corpus, std::vector<QueryParameter> &parameters);
+PreparedQuery prepare_query(const Corpus &corpus, const std::string &text);
+// the query with its parameters bound to values, in order
+Query bind_query(const Corpus &corpus, const PreparedQuery &prepared, const std::vector<std::string> &values);
+// the plan of a query bound from a prepared one. only the sets of the
+// bound values are looked up, the others are those kept by prepare_query
+QueryPlan plan_bound(const Corpus &corpus, const PreparedQuery &prepared, const Query &query);
+// the same matches as match2 on the bound query. only the values are
+// looked up, a query without parameters is run with its own plan and one
+// with parameters with plan_bound
+std::vector<Match> execute_query(const Corpus &corpus, const PreparedQuery &prepared, const std::vector<std::string> &values = {});
+// the values of a request, "-quoted and separated by spaces
+std::vector<std::string> parse_values(std::string_view text);
+
+// how often a cache was asked for an entry it had, and what it holds
+struct CacheCounters
+{
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t entries = 0;
+	size_t bytes = 0;
+};
+
+// values by key, shared with whoever looked them up. once the values take
+// more than capacity bytes, the least recently used ones are dropped
+template <typename V>
+class LruCache
+{
+public:
+	explicit LruCache(size_t capacity) : capacity(capacity) {}
+
+	// if a key is cached, without counting it as a lookup
+	bool contains(const std::string &key) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.contains(key);
+	}
+
+	// the value of a key, null if it is not cached
+	std::shared_ptr<const V> find(const std::string &key)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = entries.find(key);
+		if (found == entries.end())
+		{
+			counters.misses++;
+			return nullptr;
+		}
+		counters.hits++;
+		order.splice(order.begin(), order, found->second);
+		return found->second->value;
+	}
+
+	void insert(const std::string &key, std::shared_ptr<const V> value, size_t bytes)
+	{
+		bytes += key.size();
+		std::lock_guard<std::mutex> lock(mutex);
+		if (bytes > capacity || entries.contains(key))
+		{
+			return;
+		}
+		order.push_front(Entry{key, std::move(value), bytes});
+		entries.emplace(key, order.begin());
+		counters.entries++;
+		counters.bytes += bytes;
+		while (counters.bytes > capacity)
+		{
+			counters.entries--;
+			counters.bytes -= order.back().bytes;
+			entries.erase(order.back().key);
+			order.pop_back();
+		}
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.clear();
+		order.clear();
+		counters = CacheCounters();
+	}
+
+	CacheCounters stats() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return counters;
+	}
+
+private:
+	struct Entry
+	{
+		std::string key;
+		std::shared_ptr<const V> value;
+		size_t bytes;
+	};
+
+	size_t capacity;
+	std::list<Entry> order; // the most recently used first
+	std::unordered_map<std::string, typename std::list<Entry>::iterator> entries;
+	CacheCounters counters;
+	mutable std::mutex mutex;
+};
+
+// the results of the queries run on one corpus (see cache.cpp). the
+// matches of whole queries are kept by the normalised form of the query,
+// the sets of clauses with several literals by that of the clause, so a
+// query sharing a clause with an earlier one starts from its set
+const size_t RESULT_CACHE_BYTES = 256 << 20;
+const size_t CLAUSE_CACHE_BYTES = 64 << 20;
+// the REPL keeps the matches of a query when there are at most this many,
+// those of larger results are only counted
+const size_t MAX_CACHED_MATCHES = RESULT_CACHE_BYTES / 16 / sizeof(Match);
+
+class QueryCache
+{
+public:
+	explicit QueryCache(size_t result_bytes = RESULT_CACHE_BYTES, size_t clause_bytes = CLAUSE_CACHE_BYTES)
+		: results(result_bytes), clauses(clause_bytes) {}
+	// the matches of a query, null if they are not cached
+	std::shared_ptr<const std::vector<Match>> find(const Query &query);
+	// the plan of a query with the cached sets of its clauses in place of
+	// those of their literals. held keeps the clause sets for the plan
+	QueryPlan plan(const Corpus &corpus, const Query &query, std::vector<std::shared_ptr<const MatchSet>> &held);
+	// keeps all matches of a query
+	void insert(const Query &query, std::vector<Match> &&matches);
+	// finds and keeps the sets of the query's clauses that plan would use
+	// and are not cached yet
+	void add_clauses(const Corpus &corpus, const Query &query);
+	CacheCounters result_stats() const { return results.stats(); }
+	CacheCounters clause_stats() const { return clauses.stats(); }
+	void clear();
+
+private:
+
+	LruCache<std::vector<Match>> results;
+	LruCache<MatchSet> clauses;
+};
+
+// the query with the literals of every clause in a fixed order, written
+// as a string. queries differing only in the order of their literals have
+// the same key
+std::string query_key(const Query &query);
+
+// a long running server answering queries over a socket, one request per
+// line with JSON lines in response (see server.cpp for the protocol)
+struct ServerOptions
+{
+	std::string address;	   // a unix socket path, or a port on localhost
+	size_t threads = 4;		   // requests answered at the same time
+	size_t max_matches = 1000; // matches sent per request at most
+	int timeout_ms = 10000;	   // for finding the matches of a request
+};
+
+// serves the corpus until the process is stopped
+void serve(const Corpus &corpus, const ServerOptions &options);
+
+// binary snapshot of a loaded and indexed corpus (see snapshot.cpp)
+bool is_snapshot(const std::string &filename);
+void save_snapshot(const Corpus &corpus, const std::string &filename);
+Corpus open_snapshot(const std::string &filename);
+
 #endif // CORPUS_H
\ No newline at end of file
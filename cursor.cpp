@@ -0,0 +1,315 @@
+#include "corpus.h"
+#include <algorithm>
+
+SetCursor make_cursor(const MatchSet &set)
+{
+	return std::visit([](const auto &s) -> SetCursor
+					  {
+		using T = std::decay_t<decltype(s)>;
+		if constexpr (std::is_same_v<T, DenseSet>)
+		{
+			return RangeCursor{s.first, s.last};
+		}
+		else if constexpr (std::is_same_v<T, IndexSet>)
+		{
+			return ListCursor{s.elems.data(), s.elems.data() + s.elems.size(), s.shift};
+		}
+		else if constexpr (std::is_same_v<T, ExplicitSet>)
+		{
+			return ListCursor{s.elems.data(), s.elems.data() + s.elems.size(), 0};
+		}
+		else if constexpr (std::is_same_v<T, BitmapSet>)
+		{
+			return BitmapCursor{s.words.data(), s.words.size(), s.shift};
+		}
+		else
+		{
+			// nothing decoded yet
+			BlockCursor cursor;
+			cursor.postings = s.postings;
+			cursor.block = s.first_block;
+			cursor.last_block = s.last_block;
+			cursor.shift = s.shift;
+			cursor.index = 0;
+			cursor.count = 0;
+			return cursor;
+		} }, set.set);
+}
+
+int cursor_seek(RangeCursor &cursor, int target)
+{
+	cursor.next = std::max(cursor.next, target);
+	return cursor.next < cursor.last ? cursor.next : END_POSITION;
+}
+
+int cursor_seek(ListCursor &cursor, int target)
+{
+	cursor.next = gallop(cursor.next, cursor.end, target - cursor.shift);
+	return cursor.next == cursor.end ? END_POSITION : *cursor.next + cursor.shift;
+}
+
+int cursor_seek(BlockCursor &cursor, int target)
+{
+	int wanted = target - cursor.shift;
+	if (cursor.count == 0 || cursor.positions[cursor.count - 1] < wanted)
+	{
+		// the decoded block ends before wanted, find the first block that
+		// reaches it in the skip table and decode only that one
+		const int *last = cursor.postings->block_last.data();
+		uint32_t start = cursor.count == 0 ? cursor.block : cursor.block + 1;
+		cursor.block = gallop(last + start, last + cursor.last_block, wanted) - last;
+		cursor.index = 0;
+		cursor.count = 0;
+		if (cursor.block == cursor.last_block)
+		{
+			return END_POSITION;
+		}
+		cursor.count = cursor.postings->decode(cursor.block, cursor.positions);
+	}
+	cursor.index = std::lower_bound(cursor.positions + cursor.index, cursor.positions + cursor.count, wanted) - cursor.positions;
+	return cursor.positions[cursor.index] + cursor.shift;
+}
+
+int cursor_seek(BitmapCursor &cursor, int target)
+{
+	// the first set bit from the target's on
+	int64_t bit = std::max<int64_t>(static_cast<int64_t>(target) - cursor.shift, 0);
+	size_t word = bit / 64;
+	if (word >= cursor.count)
+	{
+		return END_POSITION;
+	}
+	uint64_t bits = cursor.words[word] & (~uint64_t(0) << (bit % 64));
+	while (bits == 0)
+	{
+		if (++word == cursor.count)
+		{
+			return END_POSITION;
+		}
+		bits = cursor.words[word];
+	}
+	return static_cast<int>(word * 64 + std::countr_zero(bits)) + cursor.shift;
+}
+
+int cursor_seek(SetCursor &cursor, int target)
+{
+	return std::visit([&](auto &c)
+					  { return cursor_seek(c, target); }, cursor);
+}
+
+MatchCursor::MatchCursor(const Corpus &corpus, const Query &query)
+	: corpus(&corpus), length(query.size()), sweep(corpus)
+{
+	bool dense_sets;
+	sets = query_sets(corpus, query, dense_sets);
+	// the smallest set proposes the candidates
+	std::sort(sets.begin(), sets.end(), [](const MatchSet &A, const MatchSet &B)
+			  { return get_set_size(A) < get_set_size(B); });
+	for (const MatchSet &set : sets)
+	{
+		(set.complement ? exclude : include).push_back(make_cursor(set));
+	}
+	if (include.empty())
+	{
+		// only negated literals (or none), every token is a candidate
+		include.push_back(RangeCursor{0, static_cast<int>(corpus.size())});
+	}
+	if (query.empty())
+	{
+		target = END_POSITION;
+	}
+}
+
+MatchCursor::MatchCursor(const Corpus &corpus, const Query &query, const QueryPlan &plan)
+	: corpus(&corpus), length(query.size()), verified(plan.verified), sweep(corpus)
+{
+	// in the order of the plan, the anchor proposes the candidates
+	for (const MatchSet &set : plan.sets)
+	{
+		(set.complement ? exclude : include).push_back(make_cursor(set));
+	}
+	if (include.empty())
+	{
+		include.push_back(RangeCursor{0, static_cast<int>(corpus.size())});
+	}
+	if (query.empty())
+	{
+		target = END_POSITION;
+	}
+}
+
+// the first position >= target that is in every included set. each cursor
+// in turn seeks to the current candidate, one that overshoots makes its
+// position the new candidate, until all of them agree
+int MatchCursor::align(int target)
+{
+	int candidate = target;
+	size_t agreed = 0;
+	for (size_t i = 0; agreed < include.size(); i = (i + 1) % include.size())
+	{
+		// a rare match can be far away, the deadline is checked on the way
+		if (--steps == 0)
+		{
+			steps = DEADLINE_STEPS;
+			if (std::chrono::steady_clock::now() >= deadline)
+			{
+				expired = true;
+				return END_POSITION;
+			}
+		}
+		int pos = cursor_seek(include[i], candidate);
+		if (pos == END_POSITION)
+		{
+			return END_POSITION;
+		}
+		if (pos == candidate)
+		{
+			agreed++;
+		}
+		else
+		{
+			candidate = pos;
+			agreed = 1;
+		}
+	}
+	return candidate;
+}
+
+bool MatchCursor::advance()
+{
+	while (target != END_POSITION)
+	{
+		int pos = align(target);
+		if (pos == END_POSITION)
+		{
+			target = END_POSITION;
+			return false;
+		}
+		target = pos + 1;
+
+		bool excluded = false;
+		for (SetCursor &cursor : exclude)
+		{
+			excluded = excluded || cursor_seek(cursor, pos) == pos;
+		}
+		if (excluded)
+		{
+			continue;
+		}
+
+		sweep.seek(pos);
+		if (pos + length > sweep.end)
+		{
+			// no later start in this sentence fits either
+			target = sweep.end;
+			continue;
+		}
+
+		// the whole match is in the sentence, so are the tokens looked at
+		bool verified_all = true;
+		for (const VerifiedLiteral &literal : verified)
+		{
+			verified_all = verified_all && ((*literal.column)[pos + literal.offset] == literal.value) == literal.is_equality;
+		}
+		if (!verified_all)
+		{
+			continue;
+		}
+
+		position = pos;
+		return true;
+	}
+	return false;
+}
+
+Match MatchCursor::current() const
+{
+	return Match{static_cast<int>(sweep.sentence), position - sweep.start, length};
+}
+
+bool MatchCursor::next(Match &match)
+{
+	if (!advance())
+	{
+		return false;
+	}
+	match = current();
+	return true;
+}
+
+size_t MatchCursor::skip(size_t count)
+{
+	size_t skipped = 0;
+	while (skipped < count && advance())
+	{
+		skipped++;
+	}
+	return skipped;
+}
+
+std::vector<Match> match_range(const Corpus &corpus, const Query &query, size_t offset, size_t limit)
+{
+	std::vector<Match> matches;
+	MatchCursor cursor(corpus, query);
+	cursor.skip(offset);
+	Match match;
+	while (matches.size() < limit && cursor.next(match))
+	{
+		matches.push_back(match);
+	}
+	return matches;
+}
+
+// every start in a sentence from which length tokens fit in it
+size_t count_dense_matches(const Corpus &corpus, size_t length)
+{
+	const Array<int> &sentences = corpus.sentences;
+	size_t count = 0;
+	for (size_t i = 0; i < sentences.size(); i++)
+	{
+		size_t sentence_end = i + 1 < sentences.size() ? sentences[i + 1] : corpus.size();
+		size_t sentence_length = sentence_end - sentences[i];
+		if (sentence_length >= length)
+		{
+			count += sentence_length - length + 1;
+		}
+	}
+	return count;
+}
+
+size_t count_matches(const Corpus &corpus, const Query &query)
+{
+	bool timeout;
+	return count_matches(corpus, query, std::chrono::steady_clock::time_point::max(), timeout);
+}
+
+size_t count_matches(const Corpus &corpus, const Query &query, std::chrono::steady_clock::time_point deadline, bool &timeout)
+{
+	timeout = false;
+	if (query.empty())
+	{
+		return 0;
+	}
+	if (query.size() == 1 && query[0].size() == 1 && query[0][0].attribute != Attribute::match_all)
+	{
+		// every token with (or without) the value is a match of length one
+		const Literal &literal = query[0][0];
+		size_t count = find_index(corpus, literal.attribute)->count(literal.value);
+		return literal.is_equality ? count : corpus.size() - count;
+	}
+	if (std::all_of(query.begin(), query.end(), [](const Clause &clause)
+					{ return clause[0].attribute == Attribute::match_all; }))
+	{
+		return count_dense_matches(corpus, query.size());
+	}
+
+	MatchCursor cursor(corpus, query);
+	cursor.set_deadline(deadline);
+	size_t count = 0;
+	while (cursor.advance())
+	{
+		count++;
+	}
+	timeout = cursor.timed_out();
+	return count;
+}
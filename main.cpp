@@ -1,6 +1,8 @@
 #include <iostream>
 #include <chrono>
 #include <fstream>
+#include <charconv>
+#include <thread>
 #include "corpus.h"
 
 enum class state
@@ -11,7 +13,8 @@ enum class state
 	expect_close
 };
 
-double benchmark_query(const Corpus &corpus, const Query &query, size_t total_tokens, int num_runs, int run)
+// runs a prepared query the way a client repeating it would
+double benchmark_query(const Corpus &corpus, const PreparedQuery &query, size_t total_tokens, int num_runs, int run)
 {
 	double total_time_s = 0.0;
 	std::vector<Match> result;
@@ -19,7 +22,7 @@ double benchmark_query(const Corpus &corpus, const Query &query, size_t total_to
 	// warmup
 	for (int i = 0; i < 100; ++i)
 	{
-		match2(corpus, query);
+		execute_query(corpus, query);
 	}
 
 	// benchmark runs
@@ -27,7 +30,7 @@ double benchmark_query(const Corpus &corpus, const Query &query, size_t total_to
 	{
 		auto start = std::chrono::high_resolution_clock::now();
 
-		result = match2(corpus, query);
+		result = execute_query(corpus, query);
 
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double> elapsed = end - start;
@@ -52,21 +55,141 @@ double benchmark_query(const Corpus &corpus, const Query &query, size_t total_to
 	return avg_time_s;
 }
 
+void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " <corpus_file.csv | corpus_snapshot> [options]" << std::endl
+			  << "  --save-snapshot <file>       save the indexed corpus as a snapshot" << std::endl
+			  << "  --binary-index <attr>:<attr> build a binary index over adjacent tokens (repeatable)" << std::endl
+			  << "  --no-binary-indices          only build the unary indexes" << std::endl
+			  << "  --compress-postings          keep the unary indexes as compressed posting lists" << std::endl
+			  << "  --serve <socket | port>      answer queries over a unix socket or a localhost port" << std::endl
+			  << "  --threads <n>                requests the server answers at the same time" << std::endl
+			  << "  --max-matches <n>            matches the server sends per request at most" << std::endl
+			  << "  --timeout-ms <n>             time the server spends on a request at most" << std::endl;
+}
+
+// a whole number option value, false if it is not one
+template <typename T>
+bool parse_number(const std::string &text, T &value)
+{
+	auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+	return error == std::errc() && end == text.data() + text.size();
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
-    {
-        std::cerr << "Usage: " << argv[0] << " <corpus_file.csv>" << std::endl;
-        return 1;
-    }
+	if (argc < 2)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
 
-	// clear terminal
-	std::cout << "\033[H\033[2J" << std::endl;
-	std::cout << "\033[1;34mIndexing Corpus...\033[0m" << std::endl;
+	std::string snapshot_file;
+	IndexOptions options;
+	std::vector<std::pair<std::string, std::string>> &binary_indices = options.binary_indices;
+	bool default_binary_indices = true;
+	ServerOptions server;
+	server.threads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 2; i < argc; i++)
+	{
+		std::string option = argv[i];
+		if (option == "--save-snapshot" && i + 1 < argc)
+		{
+			snapshot_file = argv[++i];
+		}
+		else if (option == "--binary-index" && i + 1 < argc)
+		{
+			std::string pair = argv[++i];
+			size_t colon = pair.find(':');
+			if (colon == std::string::npos)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			if (default_binary_indices)
+			{
+				binary_indices.clear();
+				default_binary_indices = false;
+			}
+			binary_indices.emplace_back(pair.substr(0, colon), pair.substr(colon + 1));
+		}
+		else if (option == "--no-binary-indices")
+		{
+			binary_indices.clear();
+			default_binary_indices = false;
+		}
+		else if (option == "--compress-postings")
+		{
+			options.compress_postings = true;
+		}
+		else if (option == "--serve" && i + 1 < argc)
+		{
+			server.address = argv[++i];
+		}
+		else if (option == "--threads" && i + 1 < argc && parse_number(argv[i + 1], server.threads))
+		{
+			i++;
+		}
+		else if (option == "--max-matches" && i + 1 < argc && parse_number(argv[i + 1], server.max_matches))
+		{
+			i++;
+		}
+		else if (option == "--timeout-ms" && i + 1 < argc && parse_number(argv[i + 1], server.timeout_ms))
+		{
+			i++;
+		}
+		else
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// a snapshot keeps the indexes it was saved with
+	bool snapshot = is_snapshot(argv[1]);
+	if (snapshot && (!default_binary_indices || options.compress_postings))
+	{
+		std::cerr << "Error: --binary-index, --no-binary-indices and --compress-postings have no effect on a snapshot, "
+				  << "save a new one from the text corpus with the options instead" << std::endl;
+		return 1;
+	}
 
-    // load the corpus
-	Corpus corpus = load_corpus(argv[1]);
-	build_indices(corpus);
+	if (server.address.empty())
+	{
+		// clear terminal
+		std::cout << "\033[H\033[2J" << std::endl;
+		std::cout << "\033[1;34mIndexing Corpus...\033[0m" << std::endl;
+	}
+
+	Corpus corpus;
+	try
+	{
+		if (snapshot)
+		{
+			// already indexed, just map it
+			corpus = open_snapshot(argv[1]);
+		}
+		else
+		{
+			// load the corpus
+			corpus = load_corpus(argv[1]);
+			build_indices(corpus, options);
+		}
+
+		if (!snapshot_file.empty())
+		{
+			save_snapshot(corpus, snapshot_file);
+		}
+		if (!server.address.empty())
+		{
+			serve(corpus, server);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
 
 	/*uint32_t index = corpus.string2index["bodybuilder"];
 	uint32_t index2 = corpus.string2index["bodybuilders"];
@@ -91,6 +214,8 @@ int main(int argc, char *argv[])
 	// clear
 	// std::cout << corpus.string2index.size() << corpus.index2string.size() << std::endl;
 	std::string text = "";
+	// repeated queries and clauses are answered from here
+	QueryCache cache;
 	std::cout << "\033[H\033[2J" << std::endl;
 	while (true)
 	{
@@ -105,14 +230,14 @@ int main(int argc, char *argv[])
 		{
 			// run benchmarks
 			std::cout << "Running benchmarks..." << std::endl;
-			std::cout << corpus.tokens.size() << std::endl;
+			std::cout << corpus.size() << std::endl;
 			const std::string pattern1 = "[lemma=\"a\"]";
 			const std::string pattern2 = "[lemma=\"house\" word!=\"House\" pos=\"SUBST\"][]";
 			const std::string pattern3 = "[word=\"Nothing\"][][][lemma!=\"be\"][][word=\"palmtrees\" lemma=\"palmtree\"][word!=\"way\"][][word=\"And\"]";
 
-			double avg_time1 = benchmark_query(corpus, parse_query(pattern1, corpus), corpus.tokens.size(), 1000, 1);
-			double avg_time2 = benchmark_query(corpus, parse_query(pattern2, corpus), corpus.tokens.size(), 1000, 2);
-			double avg_time3 = benchmark_query(corpus, parse_query(pattern3, corpus), corpus.tokens.size(), 1000, 3);
+			double avg_time1 = benchmark_query(corpus, prepare_query(corpus, pattern1), corpus.size(), 1000, 1);
+			double avg_time2 = benchmark_query(corpus, prepare_query(corpus, pattern2), corpus.size(), 1000, 2);
+			double avg_time3 = benchmark_query(corpus, prepare_query(corpus, pattern3), corpus.size(), 1000, 3);
 
 			double avg_time = (avg_time1 + avg_time2 + avg_time3) / 3;
 			// append the average to the file also
@@ -125,12 +250,56 @@ int main(int argc, char *argv[])
 			std::cout << "Benchmark done! Overall Average Time: " << avg_time << " s" << std::endl;
 		}
 
+		if (text == "cache" || text == "cache clear")
+		{
+			if (text == "cache clear")
+			{
+				cache.clear();
+			}
+			auto print_stats = [](const char *name, const CacheCounters &stats)
+			{
+				std::cout << name << ": " << stats.hits << " hits, " << stats.misses << " misses, " << stats.entries
+						  << " entries, " << stats.bytes / 1e6 << " MB" << std::endl;
+			};
+			print_stats("Query results", cache.result_stats());
+			print_stats("Clause sets", cache.clause_stats());
+			continue;
+		}
+
 		// text = "[lemma=\"house\" pos!=\"VERB\"]";
 		try
 		{
+			if (text.starts_with("count "))
+			{
+				// only the number of matches
+				Query query = parse_query(text.substr(6), corpus);
+				std::cout << "------ Total matches: " << count_matches(corpus, query) << " ------" << std::endl;
+				continue;
+			}
+			if (text.starts_with("explain "))
+			{
+				// the engine the planner picks and why
+				Query query = parse_query(text.substr(8), corpus);
+				std::cout << describe_plan(plan_query(corpus, query)) << std::endl;
+				continue;
+			}
 			Query query = parse_query(text, corpus);
-			std::vector<Match> matches = match2(corpus, query);
-			print_matches(corpus, matches);
+			if (std::shared_ptr<const std::vector<Match>> cached = cache.find(query))
+			{
+				print_matches(corpus, *cached);
+				continue;
+			}
+			// the first page comes from a cursor, the matches are kept if
+			// the query is not too frequent
+			std::vector<std::shared_ptr<const MatchSet>> held;
+			QueryPlan plan = cache.plan(corpus, query, held);
+			MatchCursor cursor(corpus, query, plan);
+			std::vector<Match> matches;
+			if (print_matches(corpus, cursor, matches, MAX_CACHED_MATCHES))
+			{
+				cache.insert(query, std::move(matches));
+			}
+			cache.add_clauses(corpus, query);
 		}
 		catch (const std::exception &e)
 		{
@@ -141,17 +310,23 @@ int main(int argc, char *argv[])
 }
 
 Query parse_query(const std::string &text, const Corpus &corpus)
+{
+	std::vector<QueryParameter> parameters;
+	Query query = parse_query(text, corpus, parameters);
+	if (!parameters.empty())
+	{
+		throw std::runtime_error("Error: a value ? can only be given to a prepared query");
+	}
+	return query;
+}
+
+Query parse_query(const std::string &text, const Corpus &corpus, std::vector<QueryParameter> &parameters)
 {
 	state current_state = state::attribute;
 	Query query;
 	Clause clause;
 	Literal literal;
-
-	std::string attribute;
-	std::string value;
-
-	// get th iterator
-	auto iter = corpus.string2index.end();
+	parameters.clear();
 
 	size_t i = 0;
 	while (i < text.size())
@@ -170,7 +345,7 @@ Query parse_query(const std::string &text, const Corpus &corpus)
 				{
 					// empty clause
 					i++;
-					literal.attribute = "match all";
+					literal.attribute = Attribute::match_all;
 					clause.push_back(literal);
 					query.push_back(clause);
 					current_state = state::attribute;
@@ -182,18 +357,23 @@ Query parse_query(const std::string &text, const Corpus &corpus)
 			else
 			{
 				// parse the attribute
-				attribute.clear();
-				while (i < text.size() && std::isalpha(text[i]))
+				size_t begin = i;
+				while (i < text.size() && std::isalnum(text[i]))
 				{
-					attribute += text[i];
 					i++;
 				}
+				std::string_view attribute(text.data() + begin, i - begin);
 				if (attribute.empty())
 				{
 					throw std::runtime_error("Error: expected an attribute");
 				}
+				std::optional<Attribute> known = find_attribute(attribute);
+				if (!known)
+				{
+					throw std::runtime_error("Error: unknown attribute " + std::string(attribute));
+				}
 
-				literal.attribute = attribute;
+				literal.attribute = *known;
 				// now we expect an equality sign
 				current_state = state::equality;
 				break;
@@ -230,36 +410,31 @@ Query parse_query(const std::string &text, const Corpus &corpus)
 			break;
 
 		case state::value:
-			if (i >= text.size() || text[i] != '"')
+			if (i < text.size() && text[i] == '?')
 			{
-				throw std::runtime_error("Error: expected opening: \" for value");
-			}
-			i++;
-
-			value.clear();
-			while (i < text.size() && text[i] != '"')
-			{
-				value += text[i];
+				// a parameter, its value is given when the query is run
+				parameters.push_back(QueryParameter{query.size(), clause.size()});
+				literal.value = NO_ID;
 				i++;
+				current_state = state::expect_close;
+				break;
 			}
-
 			if (i >= text.size() || text[i] != '"')
 			{
-				throw std::runtime_error("Error: expected closing: \" for value");
+				throw std::runtime_error("Error: expected opening: \" for value");
 			}
+			i++;
 
-			iter = corpus.string2index.find(value);
-
-			if (iter != corpus.string2index.end())
 			{
-				// already in map return index
-				literal.value = iter->second;
-			}
-			else
-			{
-				// this query will not match so we give it a number that does not exist
-				uint32_t id = -1;
-				literal.value = id;
+				size_t close = text.find('"', i);
+				if (close == std::string::npos)
+				{
+					throw std::runtime_error("Error: expected closing: \" for value");
+				}
+				// a value not in the vocabulary gets NO_ID which no token has
+				std::string_view value(text.data() + i, close - i);
+				literal.value = find_vocabulary(corpus, literal.attribute)->find(value);
+				i = close;
 			}
 
 			i++;
@@ -326,7 +501,6 @@ void print_tokens(const Corpus &corpus, const Match &match)
 
 	while (start != end)
 	{
-		const Token &token = corpus.tokens[start];
 		if (token_numb == match.pos)
 		{
 			highlight_token = true;
@@ -348,7 +522,7 @@ void print_tokens(const Corpus &corpus, const Match &match)
 		{
 			std::cout << "\033[0m";
 		}
-		std::cout << corpus.index2string[token.word] << "\033[0m ";
+		std::cout << corpus.word_vocab[corpus.word_column[start]] << "\033[0m ";
 		token_numb++;
 		start++;
 	}
@@ -358,7 +532,7 @@ void print_tokens(const Corpus &corpus, const Match &match)
 
 void print_matches(const Corpus &corpus, const std::vector<Match> &matches)
 {
-	// std::cout << corpus.tokens.size() << std::endl;
+	// std::cout << corpus.size() << std::endl;
 	// std::cout << corpus.sentences.size() << std::endl;
 	// std::cout << matches.size() << std::endl;
 	if (matches.size() > 10)
@@ -391,4 +565,49 @@ void print_matches(const Corpus &corpus, const std::vector<Match> &matches)
 	{
 		std::cout << "------ Total matches: " << matches.size() << " ------" << std::endl;
 	}
-}
\ No newline at end of file
+}
+// prints the first page as soon as it is found, the remaining matches are
+// only counted. all of them are kept in matches unless there are more than
+// keep, false then
+bool print_matches(const Corpus &corpus, MatchCursor &cursor, std::vector<Match> &matches, size_t keep)
+{
+	Match match;
+	while (matches.size() <= 10 && cursor.next(match))
+	{
+		matches.push_back(match);
+	}
+
+	size_t total = matches.size();
+	if (total > 10)
+	{
+		std::cout << std::endl
+				  << "Listing first 10 matches:" << std::endl;
+	}
+	else if (total > 0)
+	{
+		std::cout << std::endl
+				  << "Listing " << total << " matches:" << std::endl;
+	}
+	else
+	{
+		std::cout << "No matches found." << std::endl;
+	}
+	for (size_t i = 0; i < std::min<size_t>(total, 10); i++)
+	{
+		print_tokens(corpus, matches[i]);
+	}
+	std::cout.flush();
+
+	if (total > 0)
+	{
+		while (cursor.advance())
+		{
+			if (total++ < keep)
+			{
+				matches.push_back(cursor.current());
+			}
+		}
+		std::cout << "------ Total matches: " << total << " ------" << std::endl;
+	}
+	return total <= keep;
+}
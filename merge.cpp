@@ -0,0 +1,489 @@
+#include "corpus.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <immintrin.h>
+
+// merge kernels over two sorted lists where every element of a list is
+// read with the list's shift added. the vector versions compare a block of
+// a against a block of b in all rotations, so the result is a mask of the
+// a elements that are in the b block, and advance the block with the
+// smaller last element. they are compiled for AVX2 and AVX-512 and picked
+// at startup from what the cpu supports. lists of very different sizes are
+// handled by galloping through the larger one instead
+
+using MergeKernel = void (*)(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out);
+
+// finish a merge from a[p], b[q] on, b elements are read with delta added
+// and the output with shift added. both return how many were written
+size_t scalar_intersection(const int *a, size_t p, size_t a_size, const int *b, size_t q, size_t b_size, int delta, int shift, int *out)
+{
+	int *next = out;
+	while (p < a_size && q < b_size)
+	{
+		int shifted_b = b[q] + delta;
+		if (a[p] < shifted_b)
+		{
+			++p;
+		}
+		else if (shifted_b < a[p])
+		{
+			++q;
+		}
+		else
+		{
+			*next++ = a[p] + shift;
+			++p;
+			++q;
+		}
+	}
+	return next - out;
+}
+
+// the first elements of a from p on whose bit is set in found are already
+// known to be in b
+size_t scalar_difference(const int *a, size_t p, size_t a_size, const int *b, size_t q, size_t b_size, int delta, int shift, uint32_t found, int *out)
+{
+	int *next = out;
+	for (size_t start = p; p < a_size; ++p)
+	{
+		if (p - start < 32 && (found >> (p - start) & 1))
+		{
+			continue;
+		}
+		while (q < b_size && b[q] + delta < a[p])
+		{
+			++q;
+		}
+		if (q == b_size || b[q] + delta != a[p])
+		{
+			*next++ = a[p] + shift;
+		}
+	}
+	return next - out;
+}
+
+void merge_intersection_scalar(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	size_t start = out.size();
+	out.resize(start + std::min(a.size(), b.size()));
+	size_t count = scalar_intersection(a.data(), 0, a.size(), b.data(), 0, b.size(), shift_b - shift_a, shift_a, out.data() + start);
+	out.resize(start + count);
+}
+
+void merge_difference_scalar(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	size_t start = out.size();
+	out.resize(start + a.size());
+	size_t count = scalar_difference(a.data(), 0, a.size(), b.data(), 0, b.size(), shift_b - shift_a, shift_a, 0, out.data() + start);
+	out.resize(start + count);
+}
+
+// permutations that move the lanes selected by an 8 bit mask to the front
+constexpr std::array<std::array<uint32_t, 8>, 256> make_compress_table()
+{
+	std::array<std::array<uint32_t, 8>, 256> table{};
+	for (uint32_t mask = 0; mask < 256; mask++)
+	{
+		uint32_t next = 0;
+		for (uint32_t lane = 0; lane < 8; lane++)
+		{
+			if (mask >> lane & 1)
+			{
+				table[mask][next++] = lane;
+			}
+		}
+	}
+	return table;
+}
+constexpr std::array<std::array<uint32_t, 8>, 256> COMPRESS_TABLE = make_compress_table();
+
+// mask of the lanes of va that are equal to some lane of vb
+__attribute__((target("avx2"))) inline uint32_t match_mask_avx2(__m256i va, __m256i vb)
+{
+	const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+	__m256i equal = _mm256_cmpeq_epi32(va, vb);
+	for (int i = 1; i < 8; i++)
+	{
+		vb = _mm256_permutevar8x32_epi32(vb, rotate);
+		equal = _mm256_or_si256(equal, _mm256_cmpeq_epi32(va, vb));
+	}
+	return _mm256_movemask_ps(_mm256_castsi256_ps(equal));
+}
+
+// writes the lanes of values selected by mask (with shift added) to out
+__attribute__((target("avx2"))) inline int *store_selected_avx2(__m256i values, uint32_t mask, __m256i shift, int *out)
+{
+	__m256i order = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(COMPRESS_TABLE[mask].data()));
+	__m256i selected = _mm256_permutevar8x32_epi32(_mm256_add_epi32(values, shift), order);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(out), selected);
+	return out + std::popcount(mask);
+}
+
+__attribute__((target("avx2"))) void merge_intersection_avx2(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	size_t start = out.size();
+	// room for the overhanging store of the last block
+	out.resize(start + std::min(a.size(), b.size()) + 8);
+	int *next = out.data() + start;
+	int delta = shift_b - shift_a;
+	__m256i vdelta = _mm256_set1_epi32(delta);
+	__m256i vshift = _mm256_set1_epi32(shift_a);
+
+	size_t p = 0, q = 0;
+	while (p + 8 <= a.size() && q + 8 <= b.size())
+	{
+		__m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a.data() + p));
+		__m256i vb = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(b.data() + q)), vdelta);
+		next = store_selected_avx2(va, match_mask_avx2(va, vb), vshift, next);
+
+		int last_a = a[p + 7];
+		int last_b = b[q + 7] + delta;
+		p += last_a <= last_b ? 8 : 0;
+		q += last_b <= last_a ? 8 : 0;
+	}
+	next += scalar_intersection(a.data(), p, a.size(), b.data(), q, b.size(), delta, shift_a, next);
+	out.resize(next - out.data());
+}
+
+__attribute__((target("avx2"))) void merge_difference_avx2(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	size_t start = out.size();
+	out.resize(start + a.size() + 8);
+	int *next = out.data() + start;
+	int delta = shift_b - shift_a;
+	__m256i vdelta = _mm256_set1_epi32(delta);
+	__m256i vshift = _mm256_set1_epi32(shift_a);
+
+	// the a block is only written once it has been compared with every b
+	// block it overlaps, found collects its elements seen so far
+	uint32_t found = 0;
+	size_t p = 0, q = 0;
+	while (p + 8 <= a.size() && q + 8 <= b.size())
+	{
+		__m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a.data() + p));
+		__m256i vb = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(b.data() + q)), vdelta);
+		found |= match_mask_avx2(va, vb);
+
+		int last_a = a[p + 7];
+		int last_b = b[q + 7] + delta;
+		if (last_a <= last_b)
+		{
+			next = store_selected_avx2(va, ~found & 0xff, vshift, next);
+			found = 0;
+			p += 8;
+		}
+		q += last_b <= last_a ? 8 : 0;
+	}
+	next += scalar_difference(a.data(), p, a.size(), b.data(), q, b.size(), delta, shift_a, found, next);
+	out.resize(next - out.data());
+}
+
+// mask of the lanes of va that are equal to some lane of vb
+__attribute__((target("avx512f"))) inline uint32_t match_mask_avx512(__m512i va, __m512i vb)
+{
+	__mmask16 equal = _mm512_cmpeq_epi32_mask(va, vb);
+	for (int i = 1; i < 16; i++)
+	{
+		// the masked form, gcc 12 warns about the undefined source of the plain one
+		vb = _mm512_mask_alignr_epi32(vb, 0xffff, vb, vb, 1);
+		equal |= _mm512_cmpeq_epi32_mask(va, vb);
+	}
+	return equal;
+}
+
+__attribute__((target("avx512f"))) void merge_intersection_avx512(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	size_t start = out.size();
+	out.resize(start + std::min(a.size(), b.size()));
+	int *next = out.data() + start;
+	int delta = shift_b - shift_a;
+	__m512i vdelta = _mm512_set1_epi32(delta);
+	__m512i vshift = _mm512_set1_epi32(shift_a);
+
+	size_t p = 0, q = 0;
+	while (p + 16 <= a.size() && q + 16 <= b.size())
+	{
+		__m512i va = _mm512_loadu_si512(a.data() + p);
+		__m512i vb = _mm512_add_epi32(_mm512_loadu_si512(b.data() + q), vdelta);
+		__mmask16 mask = match_mask_avx512(va, vb);
+		_mm512_mask_compressstoreu_epi32(next, mask, _mm512_add_epi32(va, vshift));
+		next += std::popcount(static_cast<uint32_t>(mask));
+
+		int last_a = a[p + 15];
+		int last_b = b[q + 15] + delta;
+		p += last_a <= last_b ? 16 : 0;
+		q += last_b <= last_a ? 16 : 0;
+	}
+	next += scalar_intersection(a.data(), p, a.size(), b.data(), q, b.size(), delta, shift_a, next);
+	out.resize(next - out.data());
+}
+
+__attribute__((target("avx512f"))) void merge_difference_avx512(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	size_t start = out.size();
+	out.resize(start + a.size());
+	int *next = out.data() + start;
+	int delta = shift_b - shift_a;
+	__m512i vdelta = _mm512_set1_epi32(delta);
+	__m512i vshift = _mm512_set1_epi32(shift_a);
+
+	uint32_t found = 0;
+	size_t p = 0, q = 0;
+	while (p + 16 <= a.size() && q + 16 <= b.size())
+	{
+		__m512i va = _mm512_loadu_si512(a.data() + p);
+		__m512i vb = _mm512_add_epi32(_mm512_loadu_si512(b.data() + q), vdelta);
+		found |= match_mask_avx512(va, vb);
+
+		int last_a = a[p + 15];
+		int last_b = b[q + 15] + delta;
+		if (last_a <= last_b)
+		{
+			__mmask16 keep = ~found & 0xffff;
+			_mm512_mask_compressstoreu_epi32(next, keep, _mm512_add_epi32(va, vshift));
+			next += std::popcount(static_cast<uint32_t>(keep));
+			found = 0;
+			p += 16;
+		}
+		q += last_b <= last_a ? 16 : 0;
+	}
+	next += scalar_difference(a.data(), p, a.size(), b.data(), q, b.size(), delta, shift_a, found, next);
+	out.resize(next - out.data());
+}
+
+// sentence room filters: keep the start positions from which length tokens
+// fit in their sentence, read from the room column (see Corpus). the
+// vector versions gather the room bytes of a block of positions four bytes
+// at a time, which the padding of the column allows
+using RoomFilter = void (*)(std::vector<int> &positions, const uint8_t *room, int size, int length);
+
+size_t scalar_room_filter(int *positions, size_t p, size_t count, const uint8_t *room, int size, int length, int *out)
+{
+	int *next = out;
+	for (; p < count; p++)
+	{
+		int pos = positions[p];
+		if (pos >= 0 && pos < size && room[pos] >= length)
+		{
+			*next++ = pos;
+		}
+	}
+	return next - out;
+}
+
+void room_filter_scalar(std::vector<int> &positions, const uint8_t *room, int size, int length)
+{
+	positions.resize(scalar_room_filter(positions.data(), 0, positions.size(), room, size, length, positions.data()));
+}
+
+__attribute__((target("avx2"))) void room_filter_avx2(std::vector<int> &positions, const uint8_t *room, int size, int length)
+{
+	// filtered in place, the output never overtakes the block being read
+	int *data = positions.data();
+	int *next = data;
+	__m256i low_byte = _mm256_set1_epi32(0xff);
+	__m256i shortest = _mm256_set1_epi32(length - 1);
+	__m256i minus_one = _mm256_set1_epi32(-1);
+	__m256i vsize = _mm256_set1_epi32(size);
+	size_t p = 0;
+	for (; p + 8 <= positions.size(); p += 8)
+	{
+		__m256i pos = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + p));
+		__m256i inside = _mm256_and_si256(_mm256_cmpgt_epi32(pos, minus_one), _mm256_cmpgt_epi32(vsize, pos));
+		__m256i bytes = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int *>(room), pos, inside, 1);
+		__m256i keep = _mm256_and_si256(inside, _mm256_cmpgt_epi32(_mm256_and_si256(bytes, low_byte), shortest));
+		next = store_selected_avx2(pos, _mm256_movemask_ps(_mm256_castsi256_ps(keep)), _mm256_setzero_si256(), next);
+	}
+	next += scalar_room_filter(data, p, positions.size(), room, size, length, next);
+	positions.resize(next - data);
+}
+
+__attribute__((target("avx512f"))) void room_filter_avx512(std::vector<int> &positions, const uint8_t *room, int size, int length)
+{
+	int *data = positions.data();
+	int *next = data;
+	__m512i low_byte = _mm512_set1_epi32(0xff);
+	__m512i vlength = _mm512_set1_epi32(length);
+	__m512i vsize = _mm512_set1_epi32(size);
+	size_t p = 0;
+	for (; p + 16 <= positions.size(); p += 16)
+	{
+		__m512i pos = _mm512_loadu_si512(data + p);
+		// unsigned compare also rejects negative positions
+		__mmask16 inside = _mm512_cmplt_epu32_mask(pos, vsize);
+		__m512i bytes = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), inside, pos, room, 1);
+		__mmask16 keep = inside & _mm512_cmpge_epi32_mask(_mm512_and_si512(bytes, low_byte), vlength);
+		_mm512_mask_compressstoreu_epi32(next, keep, pos);
+		next += std::popcount(static_cast<uint32_t>(keep));
+	}
+	next += scalar_room_filter(data, p, positions.size(), room, size, length, next);
+	positions.resize(next - data);
+}
+
+struct Kernels
+{
+	MergeKernel intersection;
+	MergeKernel difference;
+	RoomFilter room_filter;
+};
+
+Kernels select_kernels()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		return {merge_intersection_avx512, merge_difference_avx512, room_filter_avx512};
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return {merge_intersection_avx2, merge_difference_avx2, room_filter_avx2};
+	}
+	return {merge_intersection_scalar, merge_difference_scalar, room_filter_scalar};
+}
+
+const Kernels KERNELS = select_kernels();
+
+void merge_intersection(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	KERNELS.intersection(a, shift_a, b, shift_b, out);
+}
+
+void merge_difference(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	KERNELS.difference(a, shift_a, b, shift_b, out);
+}
+
+void filter_sentence_room(std::vector<int> &positions, const Array<uint8_t> &room, int length)
+{
+	KERNELS.room_filter(positions, room.data(), room.size() - ROOM_PADDING, length);
+}
+
+size_t list_bound(std::span<const int> elems, int shift, int target)
+{
+	return std::lower_bound(elems.begin(), elems.end(), static_cast<int64_t>(target) - shift, [](int elem, int64_t value)
+							{ return elem < value; }) -
+		   elems.begin();
+}
+
+const int *gallop(const int *begin, const int *end, int target)
+{
+	if (begin == end || *begin >= target)
+	{
+		return begin;
+	}
+	// begin[low] < target, double the step until it overshoots
+	size_t size = end - begin;
+	size_t low = 0, step = 1;
+	while (low + step < size && begin[low + step] < target)
+	{
+		low += step;
+		step *= 2;
+	}
+	return std::lower_bound(begin + low + 1, begin + std::min(low + step, size), target);
+}
+
+void gallop_intersection(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	const int *next = b.data();
+	const int *end = b.data() + b.size();
+	for (int elem : a)
+	{
+		int target = elem + shift_a - shift_b;
+		next = gallop(next, end, target);
+		if (next == end)
+		{
+			break;
+		}
+		if (*next == target)
+		{
+			out.push_back(elem + shift_a);
+		}
+	}
+}
+
+void gallop_difference(std::span<const int> a, int shift_a, std::span<const int> b, int shift_b, std::vector<int> &out)
+{
+	const int *next = b.data();
+	const int *end = b.data() + b.size();
+	for (int elem : a)
+	{
+		int target = elem + shift_a - shift_b;
+		next = gallop(next, end, target);
+		if (next == end || *next != target)
+		{
+			out.push_back(elem + shift_a);
+		}
+	}
+}
+
+ExplicitSet kway_intersection(std::vector<IndexSet> lists, const std::vector<IndexSet> &excluded)
+{
+	std::sort(lists.begin(), lists.end(), [](const IndexSet &x, const IndexSet &y)
+			  { return x.elems.size() < y.elems.size(); });
+	if (lists.empty() || lists[0].elems.empty())
+	{
+		return ExplicitSet{};
+	}
+	ExplicitSet result = scratch_set(lists[0].elems.size());
+
+	// one cursor per list, the smallest list proposes candidates and every
+	// other list either confirms one or gallops past it, which moves the
+	// proposal on to the element it stopped at
+	std::vector<const int *> cursors;
+	std::vector<const int *> ends;
+	for (const IndexSet &list : lists)
+	{
+		cursors.push_back(list.elems.data());
+		ends.push_back(list.elems.data() + list.elems.size());
+	}
+	for (const IndexSet &list : excluded)
+	{
+		cursors.push_back(list.elems.data());
+		ends.push_back(list.elems.data() + list.elems.size());
+	}
+
+	size_t count = lists.size();
+	const IndexSet &driver = lists[0];
+	while (cursors[0] != ends[0])
+	{
+		int candidate = *cursors[0] + driver.shift;
+		bool agreed = true;
+		for (size_t i = 1; i < count; i++)
+		{
+			cursors[i] = gallop(cursors[i], ends[i], candidate - lists[i].shift);
+			if (cursors[i] == ends[i])
+			{
+				return result;
+			}
+			int found = *cursors[i] + lists[i].shift;
+			if (found != candidate)
+			{
+				cursors[0] = gallop(cursors[0], ends[0], found - driver.shift);
+				agreed = false;
+				break;
+			}
+		}
+		if (!agreed)
+		{
+			continue;
+		}
+
+		bool excluded_match = false;
+		for (size_t i = count; i < cursors.size(); i++)
+		{
+			int shift = excluded[i - count].shift;
+			cursors[i] = gallop(cursors[i], ends[i], candidate - shift);
+			if (cursors[i] != ends[i] && *cursors[i] + shift == candidate)
+			{
+				excluded_match = true;
+			}
+		}
+		if (!excluded_match)
+		{
+			result.elems.push_back(candidate);
+		}
+		++cursors[0];
+	}
+	return result;
+}
@@ -0,0 +1,201 @@
+#include "corpus.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+// costs in nanoseconds per element, measured on a 2M token corpus
+const double SCAN_TOKEN_COST = 0.3;	 // the scan engine moving over one position
+const double SCAN_LITERAL_COST = 0.4; // and comparing one literal there
+const double SCAN_MATCH_COST = 12;	 // the scan engine recording a match
+const double LIST_COST = 4;			 // merging one posting list element
+const double SEARCH_COST = 8;		 // one galloping step into a list
+const double VERIFY_COST = 4;		 // checking one candidate on a column
+const double PROBE_COST = 2;		 // testing one candidate's bit in a bitmap
+const double WORD_COST = 2;			 // combining one word of two bitmaps
+const double COMPLEMENT_COST = 2;	 // walking one token around a complement set
+const double INDEX_MATCH_COST = 8;	 // turning a position of a set into a match
+
+// the share of tokens a literal matches
+double selectivity(const Corpus &corpus, const Literal &literal)
+{
+	if (literal.attribute == Attribute::match_all || corpus.size() == 0)
+	{
+		return 1;
+	}
+	double share = static_cast<double>(find_index(corpus, literal.attribute)->count(literal.value)) / corpus.size();
+	return literal.is_equality ? share : 1 - share;
+}
+
+// the scan engine compares the literals for a block of starts in order
+// until none is left, so later literals are only reached by the blocks in
+// which some start passed the earlier ones
+double scan_cost(const Corpus &corpus, const Query &query)
+{
+	double checks = 0;
+	double reach = 1;
+	for (const Clause &clause : query)
+	{
+		for (const Literal &literal : clause)
+		{
+			if (literal.attribute != Attribute::match_all)
+			{
+				checks += reach;
+				reach *= 1 - std::pow(1 - selectivity(corpus, literal), SCAN_BLOCK);
+			}
+		}
+	}
+	return corpus.size() * (SCAN_TOKEN_COST + checks * SCAN_LITERAL_COST);
+}
+
+// looking up the given number of candidates in a list: galloping when they
+// are few, a merge through the whole list when they are many
+double search_cost(double candidates, double size)
+{
+	double gallop = candidates * SEARCH_COST * std::log2(size / std::max(candidates, 1.0) + 1);
+	return std::min(gallop, (candidates + size) * LIST_COST);
+}
+
+// combining the candidates with a set. bitmaps are combined a word at a
+// time, a list and a bitmap by testing the bit of every list element
+double lookup_cost(double candidates, bool bitmap_candidates, const MatchSet &set)
+{
+	const BitmapSet *bitmap = std::get_if<BitmapSet>(&set.set);
+	if (bitmap_candidates)
+	{
+		return bitmap ? bitmap->words.size() * WORD_COST : get_set_size(set) * PROBE_COST;
+	}
+	return bitmap ? candidates * PROBE_COST : search_cost(candidates, get_set_size(set));
+}
+
+QueryPlan plan_query(const Corpus &corpus, const Query &query)
+{
+	bool dense_sets;
+	std::vector<std::vector<VerifiedLiteral>> sources;
+	std::vector<MatchSet> sets = query_sets(corpus, query, dense_sets, sources);
+	return plan_query(corpus, query, sets, sources);
+}
+
+QueryPlan plan_query(const Corpus &corpus, const Query &query, const std::vector<MatchSet> &sets, const std::vector<std::vector<VerifiedLiteral>> &sources)
+{
+	QueryPlan plan;
+	// the positive sets, smallest first. negated literals are planned on
+	// their own below
+	std::vector<size_t> positive, negated;
+	for (size_t k = 0; k < sets.size(); k++)
+	{
+		(sets[k].complement ? negated : positive).push_back(k);
+	}
+	// the sets are kept in the order match_set intersects them, negated
+	// ones smallest first as well
+	auto smaller = [&](size_t a, size_t b)
+	{
+		return get_set_size(sets[a]) < get_set_size(sets[b]);
+	};
+	std::stable_sort(positive.begin(), positive.end(), smaller);
+	std::stable_sort(negated.begin(), negated.end(), smaller);
+
+	// the smallest set is the anchor proposing the candidates. every other
+	// set is either intersected with them or, when the candidates are few,
+	// its literals are checked on the columns at the shifted positions
+	double candidates = positive.empty() ? corpus.size() : get_set_size(sets[positive[0]]);
+	bool bitmap_candidates = !positive.empty() && std::holds_alternative<BitmapSet>(sets[positive[0]].set);
+	double cost = positive.empty() || bitmap_candidates ? 0 : candidates * LIST_COST;
+	// the verified literals with the share of candidates they keep
+	std::vector<std::pair<double, VerifiedLiteral>> checks;
+	auto verify_or_lookup = [&](size_t k)
+	{
+		const MatchSet &set = sets[k];
+		double share = get_set_size(set) / std::max<double>(corpus.size(), 1);
+		double lookup = positive.empty() ? lookup_cost(0, true, set) : lookup_cost(candidates, bitmap_candidates, set);
+		double verify = candidates * VERIFY_COST * sources[k].size();
+		if (!positive.empty() && verify < lookup)
+		{
+			for (const VerifiedLiteral &literal : sources[k])
+			{
+				checks.emplace_back(set.complement ? 1 - share : share, literal);
+			}
+			cost += verify;
+		}
+		else
+		{
+			plan.sets.push_back(set);
+			cost += lookup;
+		}
+	};
+	if (!positive.empty())
+	{
+		plan.sets.push_back(sets[positive[0]]);
+	}
+	for (size_t i = 1; i < positive.size(); i++)
+	{
+		verify_or_lookup(positive[i]);
+	}
+	// a negated literal either removes its posting list from the result or
+	// is checked on the column. without a positive set the candidates are
+	// every token, so the negated sets are always united instead
+	for (size_t k : negated)
+	{
+		verify_or_lookup(k);
+	}
+	if (positive.empty() && !plan.sets.empty())
+	{
+		// the matches are found by walking every token around the union
+		cost += corpus.size() * COMPLEMENT_COST;
+	}
+	// the literal keeping the fewest candidates is checked first
+	std::stable_sort(checks.begin(), checks.end(), [](const auto &a, const auto &b)
+					 { return a.first < b.first; });
+	for (const auto &check : checks)
+	{
+		plan.verified.push_back(check.second);
+	}
+
+	// at most as many matches as candidates
+	double matches = candidates;
+	for (const Clause &clause : query)
+	{
+		for (const Literal &literal : clause)
+		{
+			matches = std::min(matches, corpus.size() * selectivity(corpus, literal));
+		}
+	}
+	plan.index_cost = cost + matches * INDEX_MATCH_COST;
+	plan.scan_cost = scan_cost(corpus, query) + matches * SCAN_MATCH_COST;
+	plan.engine = plan.scan_cost < plan.index_cost ? Engine::scan : Engine::index;
+	if (plan.engine == Engine::scan)
+	{
+		plan.program = compile_scan(corpus, query);
+	}
+	return plan;
+}
+
+std::string describe_plan(const QueryPlan &plan)
+{
+	std::ostringstream text;
+	if (plan.engine == Engine::scan)
+	{
+		text << "scan engine";
+	}
+	else
+	{
+		text << "index engine, sets of";
+		for (const MatchSet &set : plan.sets)
+		{
+			text << " " << (set.complement ? "!" : "") << get_set_size(set);
+			if (std::holds_alternative<BitmapSet>(set.set))
+			{
+				text << " (bitmap)";
+			}
+		}
+		if (plan.sets.empty())
+		{
+			text << " every token";
+		}
+		if (!plan.verified.empty())
+		{
+			text << ", " << plan.verified.size() << " literal(s) verified on the columns";
+		}
+	}
+	text << " (estimated " << plan.scan_cost / 1e6 << " ms scan, " << plan.index_cost / 1e6 << " ms index)";
+	return text.str();
+}
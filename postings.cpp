@@ -0,0 +1,411 @@
+#include "corpus.h"
+#include <algorithm>
+#include <bit>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// a full block holds 128 positions v[0..127] as 32 groups of four. the
+// difference d[i] = v[i] - v[i - 4] (v[i] - v[0] for the first group) is
+// stored with the same bit width for the whole block, lane i % 4 of the
+// block packing the differences of its 32 positions into `bits` words and
+// the words of the four lanes interleaved. decoding unpacks one group of
+// four differences at a time and adds it to the previous group
+const size_t LANES = 4;
+const size_t GROUPS = POSTING_BLOCK_SIZE / LANES;
+
+CompressedPostings compress_postings(const Index &index)
+{
+	std::vector<uint32_t> value_blocks;
+	std::vector<int> block_first;
+	std::vector<int> block_last;
+	std::vector<uint8_t> block_bits;
+	std::vector<uint32_t> block_data;
+	std::vector<uint32_t> data;
+
+	size_t values = index.offsets.empty() ? 0 : index.offsets.size() - 1;
+	for (size_t value = 0; value < values; value++)
+	{
+		value_blocks.push_back(block_first.size());
+		const int *list = index.positions.data() + index.offsets[value];
+		size_t size = index.offsets[value + 1] - index.offsets[value];
+
+		for (size_t start = 0; start < size; start += POSTING_BLOCK_SIZE)
+		{
+			const int *v = list + start;
+			size_t count = std::min(POSTING_BLOCK_SIZE, size - start);
+			block_first.push_back(v[0]);
+			block_last.push_back(v[count - 1]);
+			block_data.push_back(data.size());
+
+			if (count < POSTING_BLOCK_SIZE)
+			{
+				// too short to pack, store the positions as they are
+				block_bits.push_back(RAW_BLOCK);
+				data.insert(data.end(), v, v + count);
+				continue;
+			}
+
+			uint32_t deltas[POSTING_BLOCK_SIZE];
+			uint32_t widest = 1;
+			for (size_t i = 0; i < POSTING_BLOCK_SIZE; i++)
+			{
+				deltas[i] = v[i] - (i < LANES ? v[0] : v[i - LANES]);
+				widest = std::max(widest, deltas[i]);
+			}
+			uint32_t bits = std::bit_width(widest);
+			block_bits.push_back(bits);
+
+			size_t base = data.size();
+			data.resize(base + LANES * bits, 0);
+			for (size_t group = 0; group < GROUPS; group++)
+			{
+				size_t offset = group * bits;
+				size_t word = offset / 32;
+				size_t shift = offset % 32;
+				for (size_t lane = 0; lane < LANES; lane++)
+				{
+					uint32_t delta = deltas[group * LANES + lane];
+					data[base + word * LANES + lane] |= delta << shift;
+					if (shift + bits > 32)
+					{
+						data[base + (word + 1) * LANES + lane] |= delta >> (32 - shift);
+					}
+				}
+			}
+		}
+	}
+	value_blocks.push_back(block_first.size());
+	block_data.push_back(data.size());
+
+	CompressedPostings postings;
+	postings.value_blocks = std::move(value_blocks);
+	postings.block_first = std::move(block_first);
+	postings.block_last = std::move(block_last);
+	postings.block_bits = std::move(block_bits);
+	postings.block_data = std::move(block_data);
+	postings.data = std::move(data);
+	return postings;
+}
+
+size_t CompressedPostings::decode(uint32_t block, int *out) const
+{
+	const uint32_t *words = data.data() + block_data[block];
+	uint32_t bits = block_bits[block];
+	if (bits == RAW_BLOCK)
+	{
+		size_t count = block_data[block + 1] - block_data[block];
+		std::copy(words, words + count, out);
+		return count;
+	}
+
+	uint32_t mask = bits == 32 ? ~0u : (1u << bits) - 1;
+#ifdef __SSE2__
+	const __m128i *packed = reinterpret_cast<const __m128i *>(words);
+	__m128i lane_mask = _mm_set1_epi32(mask);
+	__m128i previous = _mm_set1_epi32(block_first[block]);
+	for (size_t group = 0; group < GROUPS; group++)
+	{
+		size_t offset = group * bits;
+		size_t word = offset / 32;
+		size_t shift = offset % 32;
+		__m128i delta = _mm_srl_epi32(_mm_loadu_si128(packed + word), _mm_cvtsi32_si128(shift));
+		if (shift + bits > 32)
+		{
+			__m128i high = _mm_sll_epi32(_mm_loadu_si128(packed + word + 1), _mm_cvtsi32_si128(32 - shift));
+			delta = _mm_or_si128(delta, high);
+		}
+		previous = _mm_add_epi32(previous, _mm_and_si128(delta, lane_mask));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + group * LANES), previous);
+	}
+#else
+	uint32_t previous[LANES];
+	std::fill(previous, previous + LANES, block_first[block]);
+	for (size_t group = 0; group < GROUPS; group++)
+	{
+		size_t offset = group * bits;
+		size_t word = offset / 32;
+		size_t shift = offset % 32;
+		for (size_t lane = 0; lane < LANES; lane++)
+		{
+			uint32_t delta = words[word * LANES + lane] >> shift;
+			if (shift + bits > 32)
+			{
+				delta |= words[(word + 1) * LANES + lane] << (32 - shift);
+			}
+			previous[lane] += delta & mask;
+			out[group * LANES + lane] = previous[lane];
+		}
+	}
+#endif
+	return POSTING_BLOCK_SIZE;
+}
+
+CompressedSet compressed_lookup(const Corpus &corpus, Attribute attribute, uint32_t value)
+{
+	const Index *index = find_index(corpus, attribute);
+	const CompressedPostings &postings = index->compressed;
+
+	CompressedSet set{&postings, 0, 0, 0, 0};
+	if (value < postings.value_blocks.size() - 1)
+	{
+		set.first_block = postings.value_blocks[value];
+		set.last_block = postings.value_blocks[value + 1];
+		set.size = index->count(value);
+	}
+	return set;
+}
+
+// the elements of a sorted list whose shifted value lies in [first, last],
+// searched from begin on
+std::span<const int> shifted_range(const int *begin, const int *end, int shift, int first, int last)
+{
+	const int *from = std::lower_bound(begin, end, first - shift);
+	const int *to = std::upper_bound(from, end, last - shift);
+	return std::span<const int>(from, to);
+}
+
+ExplicitSet intersection(const CompressedSet &A, const DenseSet &B)
+{
+	ExplicitSet result = scratch_set(std::min<size_t>(A.size, std::max(B.last - B.first, 0)));
+	const CompressedPostings &postings = *A.postings;
+	int block[POSTING_BLOCK_SIZE];
+	for (uint32_t b = A.first_block; b < A.last_block; b++)
+	{
+		if (postings.block_last[b] + A.shift < B.first || postings.block_first[b] + A.shift >= B.last)
+		{
+			// the skip table shows the block is outside B
+			continue;
+		}
+		size_t count = postings.decode(b, block);
+		for (size_t i = 0; i < count; i++)
+		{
+			int pos = block[i] + A.shift;
+			if (pos >= B.first && pos < B.last)
+			{
+				result.elems.push_back(pos);
+			}
+		}
+	}
+	return result;
+}
+
+ExplicitSet intersection(const CompressedSet &A, const IndexSet &B)
+{
+	ExplicitSet result = scratch_set(std::min(A.size, B.elems.size()));
+	const CompressedPostings &postings = *A.postings;
+	int block[POSTING_BLOCK_SIZE];
+	const int *next = B.elems.data();
+	const int *end = B.elems.data() + B.elems.size();
+	for (uint32_t b = A.first_block; b < A.last_block && next != end; b++)
+	{
+		// only decode blocks that B has elements in
+		std::span<const int> range = shifted_range(next, end, B.shift, postings.block_first[b] + A.shift, postings.block_last[b] + A.shift);
+		if (range.empty())
+		{
+			next = range.data();
+			continue;
+		}
+		size_t count = postings.decode(b, block);
+		merge_intersection(std::span<const int>(block, count), A.shift, range, B.shift, result.elems);
+		next = range.data() + range.size();
+	}
+	return result;
+}
+
+ExplicitSet intersection(const CompressedSet &A, const ExplicitSet &B)
+{
+	return intersection(A, IndexSet{B.elems, 0});
+}
+
+ExplicitSet intersection(const CompressedSet &A, const CompressedSet &B)
+{
+	ExplicitSet result = scratch_set(std::min(A.size, B.size));
+	const CompressedPostings &a_postings = *A.postings;
+	const CompressedPostings &b_postings = *B.postings;
+	int a_block[POSTING_BLOCK_SIZE];
+	int b_block[POSTING_BLOCK_SIZE];
+	size_t b_count = 0;
+	uint32_t decoded = B.last_block;
+
+	uint32_t next = B.first_block;
+	for (uint32_t a = A.first_block; a < A.last_block; a++)
+	{
+		int first = a_postings.block_first[a] + A.shift;
+		int last = a_postings.block_last[a] + A.shift;
+		// skip the blocks of B that end before this block
+		while (next < B.last_block && b_postings.block_last[next] + B.shift < first)
+		{
+			next++;
+		}
+		if (next == B.last_block)
+		{
+			break;
+		}
+		if (b_postings.block_first[next] + B.shift > last)
+		{
+			continue;
+		}
+
+		size_t a_count = a_postings.decode(a, a_block);
+		for (uint32_t b = next; b < B.last_block && b_postings.block_first[b] + B.shift <= last; b++)
+		{
+			if (decoded != b)
+			{
+				b_count = b_postings.decode(b, b_block);
+				decoded = b;
+			}
+			merge_intersection(std::span<const int>(a_block, a_count), A.shift, std::span<const int>(b_block, b_count), B.shift, result.elems);
+		}
+	}
+	return result;
+}
+
+ExplicitSet intersection(const DenseSet &B, const CompressedSet &A)
+{
+	return intersection(A, B);
+}
+
+ExplicitSet intersection(const IndexSet &B, const CompressedSet &A)
+{
+	return intersection(A, B);
+}
+
+ExplicitSet intersection(const ExplicitSet &B, const CompressedSet &A)
+{
+	return intersection(A, B);
+}
+
+ExplicitSet difference(const CompressedSet &A, const DenseSet &B)
+{
+	ExplicitSet result = scratch_set(A.size);
+	for_each_block(A, [&](std::span<const int> block)
+				   {
+		for (int elem : block)
+		{
+			int pos = elem + A.shift;
+			if (pos < B.first || pos >= B.last)
+			{
+				result.elems.push_back(pos);
+			}
+		} });
+	return result;
+}
+
+ExplicitSet difference(const CompressedSet &A, const IndexSet &B)
+{
+	ExplicitSet result = scratch_set(A.size);
+	const CompressedPostings &postings = *A.postings;
+	int block[POSTING_BLOCK_SIZE];
+	const int *next = B.elems.data();
+	const int *end = B.elems.data() + B.elems.size();
+	for (uint32_t b = A.first_block; b < A.last_block; b++)
+	{
+		std::span<const int> range = shifted_range(next, end, B.shift, postings.block_first[b] + A.shift, postings.block_last[b] + A.shift);
+		size_t count = postings.decode(b, block);
+		merge_difference(std::span<const int>(block, count), A.shift, range, B.shift, result.elems);
+		next = range.data() + range.size();
+	}
+	return result;
+}
+
+ExplicitSet difference(const CompressedSet &A, const ExplicitSet &B)
+{
+	return difference(A, IndexSet{B.elems, 0});
+}
+
+ExplicitSet difference(const CompressedSet &A, const CompressedSet &B)
+{
+	ExplicitSet result = scratch_set(A.size);
+	const CompressedPostings &a_postings = *A.postings;
+	const CompressedPostings &b_postings = *B.postings;
+	int a_block[POSTING_BLOCK_SIZE];
+	std::vector<int> overlap;
+
+	uint32_t next = B.first_block;
+	for (uint32_t a = A.first_block; a < A.last_block; a++)
+	{
+		int first = a_postings.block_first[a] + A.shift;
+		int last = a_postings.block_last[a] + A.shift;
+		while (next < B.last_block && b_postings.block_last[next] + B.shift < first)
+		{
+			next++;
+		}
+
+		// everything of B that can be in this block
+		overlap.clear();
+		for (uint32_t b = next; b < B.last_block && b_postings.block_first[b] + B.shift <= last; b++)
+		{
+			size_t offset = overlap.size();
+			overlap.resize(offset + POSTING_BLOCK_SIZE);
+			overlap.resize(offset + b_postings.decode(b, overlap.data() + offset));
+		}
+
+		size_t a_count = a_postings.decode(a, a_block);
+		merge_difference(std::span<const int>(a_block, a_count), A.shift, overlap, B.shift, result.elems);
+	}
+	return result;
+}
+
+ExplicitSet difference(const DenseSet &A, const CompressedSet &B)
+{
+	ExplicitSet result = scratch_set(std::max(A.last - A.first, 0));
+	int pos = A.first;
+	for_each_block(B, [&](std::span<const int> block)
+				   {
+		for (int elem : block)
+		{
+			int removed = elem + B.shift;
+			if (removed < pos)
+			{
+				continue;
+			}
+			for (; pos < removed && pos < A.last; pos++)
+			{
+				result.elems.push_back(pos);
+			}
+			pos = std::max(pos, std::min(removed + 1, A.last));
+		} });
+	for (; pos < A.last; pos++)
+	{
+		result.elems.push_back(pos);
+	}
+	return result;
+}
+
+ExplicitSet difference(const IndexSet &A, const CompressedSet &B)
+{
+	ExplicitSet result = scratch_set(A.elems.size());
+	const CompressedPostings &postings = *B.postings;
+	int block[POSTING_BLOCK_SIZE];
+	const int *next = A.elems.data();
+	const int *end = A.elems.data() + A.elems.size();
+	for (uint32_t b = B.first_block; b < B.last_block && next != end; b++)
+	{
+		// elements before the block are kept, the ones in its range are
+		// checked against the decoded block
+		int first = postings.block_first[b] + B.shift;
+		int last = postings.block_last[b] + B.shift;
+		std::span<const int> range = shifted_range(next, end, A.shift, first, last);
+		for (; next != range.data(); next++)
+		{
+			result.elems.push_back(*next + A.shift);
+		}
+		if (!range.empty())
+		{
+			size_t count = postings.decode(b, block);
+			merge_difference(range, A.shift, std::span<const int>(block, count), B.shift, result.elems);
+		}
+		next = range.data() + range.size();
+	}
+	for (; next != end; next++)
+	{
+		result.elems.push_back(*next + A.shift);
+	}
+	return result;
+}
+
+ExplicitSet difference(const ExplicitSet &A, const CompressedSet &B)
+{
+	return difference(IndexSet{A.elems, 0}, B);
+}
@@ -0,0 +1,107 @@
+#include "corpus.h"
+#include <stdexcept>
+
+// a prepared query keeps what does not depend on its parameters: the
+// parsed clauses with their values resolved and the sets of the literals
+// that are not parameters, or the whole plan if there are none. running it
+// again skips the parsing and the lookups of the text. with parameters,
+// only the sets of the bound values are looked up and the planner orders
+// them with the kept ones, choosing the engine by their sizes, which
+// depend on the values
+
+PreparedQuery prepare_query(const Corpus &corpus, const std::string &text)
+{
+	PreparedQuery prepared;
+	prepared.query = parse_query(text, corpus, prepared.parameters);
+	if (prepared.parameters.empty())
+	{
+		prepared.plan = plan_query(corpus, prepared.query);
+		return prepared;
+	}
+
+	// the query without its parameters, from the last one so the literals
+	// of the others stay in place. a clause left empty matches any token
+	Query fixed = prepared.query;
+	for (auto parameter = prepared.parameters.rbegin(); parameter != prepared.parameters.rend(); parameter++)
+	{
+		Clause &clause = fixed[parameter->clause];
+		clause.erase(clause.begin() + parameter->literal);
+	}
+	for (Clause &clause : fixed)
+	{
+		if (clause.empty())
+		{
+			clause.push_back(Literal{Attribute::match_all, 0, true});
+		}
+	}
+	bool dense_sets;
+	prepared.sets = query_sets(corpus, fixed, dense_sets, prepared.sources);
+	return prepared;
+}
+
+Query bind_query(const Corpus &corpus, const PreparedQuery &prepared, const std::vector<std::string> &values)
+{
+	if (values.size() != prepared.parameters.size())
+	{
+		throw std::runtime_error("Error: expected " + std::to_string(prepared.parameters.size()) + " value(s), got " + std::to_string(values.size()));
+	}
+	Query query = prepared.query;
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		Literal &literal = query[prepared.parameters[i].clause][prepared.parameters[i].literal];
+		literal.value = find_vocabulary(corpus, literal.attribute)->find(values[i]);
+	}
+	return query;
+}
+
+QueryPlan plan_bound(const Corpus &corpus, const PreparedQuery &prepared, const Query &query)
+{
+	std::vector<MatchSet> sets = prepared.sets;
+	std::vector<std::vector<VerifiedLiteral>> sources = prepared.sources;
+	for (const QueryParameter &parameter : prepared.parameters)
+	{
+		const Literal &literal = query[parameter.clause][parameter.literal];
+		int offset = static_cast<int>(parameter.clause);
+		sets.push_back(match_set(corpus, literal, -offset));
+		sources.push_back({VerifiedLiteral{find_column(corpus, literal.attribute), literal.value, offset, literal.is_equality}});
+	}
+	return plan_query(corpus, query, sets, sources);
+}
+
+std::vector<Match> execute_query(const Corpus &corpus, const PreparedQuery &prepared, const std::vector<std::string> &values)
+{
+	if (prepared.parameters.empty() && values.empty())
+	{
+		return match_sharded(corpus, prepared.query, prepared.plan);
+	}
+	Query query = bind_query(corpus, prepared, values);
+	return match_sharded(corpus, query, plan_bound(corpus, prepared, query));
+}
+
+std::vector<std::string> parse_values(std::string_view text)
+{
+	std::vector<std::string> values;
+	size_t i = 0;
+	while (true)
+	{
+		while (i < text.size() && text[i] == ' ')
+		{
+			i++;
+		}
+		if (i == text.size())
+		{
+			return values;
+		}
+		if (text[i] != '"')
+		{
+			throw std::runtime_error("Error: expected opening: \" for value");
+		}
+		size_t close = text.find('"', i + 1);
+		if (close == std::string_view::npos)
+		{
+			throw std::runtime_error("Error: expected closing: \" for value");
+		}
+		values.emplace_back(text.substr(i + 1, close - i - 1));
+		i = close + 1;
+	}
+}
@@ -0,0 +1,270 @@
+#include "corpus.h"
+#include <algorithm>
+#include <bit>
+#include <immintrin.h>
+
+// the scan engine compares the columns with the literal values for a block
+// of SCAN_BLOCK start positions at a time. every comparison gives a mask
+// with a bit per start, the masks of all literals are ANDed and the bits
+// left over are the matches. a literal of clause i reads the column from
+// start + i, so its mask lines up with the starts without shifting
+
+// equality masks of SCAN_BLOCK column values, one kernel per column width
+using EqualMask = uint64_t (*)(const void *values, uint32_t value);
+// starts whose sentence room is at least length
+using RoomMask = uint64_t (*)(const uint8_t *room, int length);
+
+template <typename T>
+uint64_t equal_mask_scalar(const void *values, uint32_t value)
+{
+	const T *data = static_cast<const T *>(values);
+	uint64_t mask = 0;
+	for (int j = 0; j < SCAN_BLOCK; j++)
+	{
+		mask |= static_cast<uint64_t>(data[j] == value) << j;
+	}
+	return mask;
+}
+
+uint64_t room_mask_scalar(const uint8_t *room, int length)
+{
+	uint64_t mask = 0;
+	for (int j = 0; j < SCAN_BLOCK; j++)
+	{
+		mask |= static_cast<uint64_t>(room[j] >= length) << j;
+	}
+	return mask;
+}
+
+__attribute__((target("avx2"))) inline uint64_t byte_mask_avx2(__m256i low, __m256i high)
+{
+	return static_cast<uint32_t>(_mm256_movemask_epi8(low)) | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(high))) << 32;
+}
+
+__attribute__((target("avx2"))) uint64_t equal_mask_8_avx2(const void *values, uint32_t value)
+{
+	const __m256i *data = static_cast<const __m256i *>(values);
+	__m256i v = _mm256_set1_epi8(static_cast<char>(value));
+	return byte_mask_avx2(_mm256_cmpeq_epi8(_mm256_loadu_si256(data), v), _mm256_cmpeq_epi8(_mm256_loadu_si256(data + 1), v));
+}
+
+__attribute__((target("avx2"))) inline __m256i word_compare_avx2(const __m256i *data, __m256i v)
+{
+	// packing interleaves the 128 bit lanes, the permute puts them back
+	__m256i low = _mm256_cmpeq_epi16(_mm256_loadu_si256(data), v);
+	__m256i high = _mm256_cmpeq_epi16(_mm256_loadu_si256(data + 1), v);
+	return _mm256_permute4x64_epi64(_mm256_packs_epi16(low, high), 0xd8);
+}
+
+__attribute__((target("avx2"))) uint64_t equal_mask_16_avx2(const void *values, uint32_t value)
+{
+	const __m256i *data = static_cast<const __m256i *>(values);
+	__m256i v = _mm256_set1_epi16(static_cast<short>(value));
+	return byte_mask_avx2(word_compare_avx2(data, v), word_compare_avx2(data + 2, v));
+}
+
+__attribute__((target("avx2"))) uint64_t equal_mask_32_avx2(const void *values, uint32_t value)
+{
+	const __m256i *data = static_cast<const __m256i *>(values);
+	__m256i v = _mm256_set1_epi32(static_cast<int>(value));
+	uint64_t mask = 0;
+	for (int j = 0; j < SCAN_BLOCK / 8; j++)
+	{
+		__m256i equal = _mm256_cmpeq_epi32(_mm256_loadu_si256(data + j), v);
+		mask |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(equal))) << (8 * j);
+	}
+	return mask;
+}
+
+__attribute__((target("avx2"))) uint64_t room_mask_avx2(const uint8_t *room, int length)
+{
+	// room >= length as max(room, length) == room
+	const __m256i *data = reinterpret_cast<const __m256i *>(room);
+	__m256i vlength = _mm256_set1_epi8(static_cast<char>(length));
+	__m256i low = _mm256_loadu_si256(data);
+	__m256i high = _mm256_loadu_si256(data + 1);
+	return byte_mask_avx2(_mm256_cmpeq_epi8(_mm256_max_epu8(low, vlength), low), _mm256_cmpeq_epi8(_mm256_max_epu8(high, vlength), high));
+}
+
+__attribute__((target("avx512f,avx512bw"))) uint64_t equal_mask_8_avx512(const void *values, uint32_t value)
+{
+	return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(values), _mm512_set1_epi8(static_cast<char>(value)));
+}
+
+__attribute__((target("avx512f,avx512bw"))) uint64_t equal_mask_16_avx512(const void *values, uint32_t value)
+{
+	const uint16_t *data = static_cast<const uint16_t *>(values);
+	__m512i v = _mm512_set1_epi16(static_cast<short>(value));
+	uint64_t low = _mm512_cmpeq_epi16_mask(_mm512_loadu_si512(data), v);
+	uint64_t high = _mm512_cmpeq_epi16_mask(_mm512_loadu_si512(data + 32), v);
+	return low | high << 32;
+}
+
+__attribute__((target("avx512f"))) uint64_t equal_mask_32_avx512(const void *values, uint32_t value)
+{
+	const uint32_t *data = static_cast<const uint32_t *>(values);
+	__m512i v = _mm512_set1_epi32(static_cast<int>(value));
+	uint64_t mask = 0;
+	for (int j = 0; j < SCAN_BLOCK / 16; j++)
+	{
+		mask |= static_cast<uint64_t>(_mm512_cmpeq_epi32_mask(_mm512_loadu_si512(data + 16 * j), v)) << (16 * j);
+	}
+	return mask;
+}
+
+__attribute__((target("avx512f,avx512bw"))) uint64_t room_mask_avx512(const uint8_t *room, int length)
+{
+	return _mm512_cmpge_epu8_mask(_mm512_loadu_si512(room), _mm512_set1_epi8(static_cast<char>(length)));
+}
+
+struct ScanKernels
+{
+	EqualMask equal[3]; // by column width: 8, 16 and 32 bits
+	RoomMask room;
+};
+
+ScanKernels select_scan_kernels()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+	{
+		return {{equal_mask_8_avx512, equal_mask_16_avx512, equal_mask_32_avx512}, room_mask_avx512};
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return {{equal_mask_8_avx2, equal_mask_16_avx2, equal_mask_32_avx2}, room_mask_avx2};
+	}
+	return {{equal_mask_scalar<uint8_t>, equal_mask_scalar<uint16_t>, equal_mask_scalar<uint32_t>}, room_mask_scalar};
+}
+
+const ScanKernels SCAN_KERNELS = select_scan_kernels();
+
+ScanProgram compile_scan(const Corpus &corpus, const Query &query)
+{
+	ScanProgram program;
+	program.length = static_cast<int>(query.size());
+	std::vector<double> shares;
+	for (size_t i = 0; i < query.size(); i++)
+	{
+		for (const Literal &literal : query[i])
+		{
+			if (literal.attribute == Attribute::match_all)
+			{
+				continue;
+			}
+			if (literal.value == NO_ID)
+			{
+				// no token has the value: every token differs from it
+				program.never = program.never || literal.is_equality;
+				continue;
+			}
+			program.literals.push_back(ScanLiteral{find_column(corpus, literal.attribute), static_cast<int>(i), literal.value, !literal.is_equality});
+			double share = static_cast<double>(find_index(corpus, literal.attribute)->count(literal.value)) / corpus.size();
+			shares.push_back(literal.is_equality ? share : 1 - share);
+		}
+	}
+
+	// the literal matching the fewest tokens first, a block is left as
+	// soon as no start survives
+	std::vector<size_t> order(program.literals.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+					 { return shares[a] < shares[b]; });
+	std::vector<ScanLiteral> sorted;
+	for (size_t i : order)
+	{
+		sorted.push_back(program.literals[i]);
+	}
+	program.literals = std::move(sorted);
+	return program;
+}
+
+// the mask of a literal for the last count < SCAN_BLOCK starts, which the
+// vector kernels would read past the end of the column for
+uint64_t partial_mask(const ScanLiteral &literal, int base, int count)
+{
+	uint64_t mask = 0;
+	with_literal_test(*literal.column, literal.value, !literal.negated, [&](auto test)
+					  {
+		for (int j = 0; j < count; j++)
+		{
+			mask |= static_cast<uint64_t>(test(base + literal.offset + j)) << j;
+		} });
+	return mask;
+}
+
+std::vector<Match> run_scan(const Corpus &corpus, const ScanProgram &program)
+{
+	return run_scan(corpus, program, 0, static_cast<int>(corpus.size()));
+}
+
+std::vector<Match> run_scan(const Corpus &corpus, const ScanProgram &program, int first, int last)
+{
+	std::vector<Match> matches;
+	int starts = std::min(last, static_cast<int>(corpus.size()) - program.length + 1);
+	if (program.never || program.length == 0 || starts <= first)
+	{
+		return matches;
+	}
+
+	// the column data and kernel of every literal, resolved once
+	struct Operand
+	{
+		const char *values;
+		int width;
+		EqualMask equal;
+		uint64_t flip;
+	};
+	std::vector<Operand> operands;
+	for (const ScanLiteral &literal : program.literals)
+	{
+		std::visit([&](const auto &array)
+				   {
+			using T = typename std::decay_t<decltype(array)>::value_type;
+			int kernel = std::countr_zero(sizeof(T));
+			operands.push_back(Operand{reinterpret_cast<const char *>(array.data() + literal.offset), static_cast<int>(sizeof(T)), SCAN_KERNELS.equal[kernel], literal.negated ? ~uint64_t(0) : 0}); }, literal.column->values);
+	}
+	bool use_room = program.length > 1 && program.length <= MAX_ROOM && !corpus.sentence_room.empty();
+
+	SentenceSweep sweep(corpus);
+	auto add_matches = [&](int base, uint64_t mask)
+	{
+		while (mask != 0)
+		{
+			int pos = base + std::countr_zero(mask);
+			mask &= mask - 1;
+			sweep.seek(pos);
+			if (pos + program.length <= sweep.end)
+			{
+				matches.push_back(Match{static_cast<int>(sweep.sentence), pos - sweep.start, program.length});
+			}
+		}
+	};
+
+	// full blocks read every literal's column at most up to the last token
+	int base = first;
+	for (; base + SCAN_BLOCK <= starts; base += SCAN_BLOCK)
+	{
+		uint64_t mask = use_room ? SCAN_KERNELS.room(corpus.sentence_room.data() + base, program.length) : ~uint64_t(0);
+		for (size_t i = 0; i < operands.size() && mask != 0; i++)
+		{
+			const Operand &operand = operands[i];
+			mask &= operand.equal(operand.values + static_cast<size_t>(base) * operand.width, program.literals[i].value) ^ operand.flip;
+		}
+		add_matches(base, mask);
+	}
+	if (base < starts)
+	{
+		// the sentence bounds are checked when the matches are added
+		uint64_t mask = (uint64_t(1) << (starts - base)) - 1;
+		for (const ScanLiteral &literal : program.literals)
+		{
+			mask &= partial_mask(literal, base, starts - base);
+		}
+		add_matches(base, mask);
+	}
+	return matches;
+}
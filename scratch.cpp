@@ -0,0 +1,74 @@
+#include "corpus.h"
+#include <algorithm>
+
+// the position lists of intermediate sets come from a pool of the thread
+// and go back to it when the set is dropped, so the next intersection
+// (or the next query on the thread) reuses their memory
+
+struct ScratchPool
+{
+	std::vector<std::vector<int>> buffers;
+	size_t bytes = 0; // capacity of the buffers
+};
+
+thread_local ScratchPool SCRATCH_POOL;
+
+std::vector<int> scratch_positions(size_t capacity)
+{
+	std::vector<std::vector<int>> &buffers = SCRATCH_POOL.buffers;
+	// the smallest buffer with the capacity, else the largest one
+	auto best = buffers.end();
+	for (auto it = buffers.begin(); it != buffers.end(); ++it)
+	{
+		if (best == buffers.end())
+		{
+			best = it;
+		}
+		else if (best->capacity() >= capacity)
+		{
+			if (it->capacity() >= capacity && it->capacity() < best->capacity())
+			{
+				best = it;
+			}
+		}
+		else if (it->capacity() > best->capacity())
+		{
+			best = it;
+		}
+	}
+	std::vector<int> buffer;
+	if (best != buffers.end())
+	{
+		buffer = std::move(*best);
+		buffers.erase(best);
+		SCRATCH_POOL.bytes -= buffer.capacity() * sizeof(int);
+	}
+	buffer.clear();
+	buffer.reserve(capacity);
+	return buffer;
+}
+
+ExplicitSet scratch_set(size_t capacity)
+{
+	return ExplicitSet{scratch_positions(capacity)};
+}
+
+void recycle(std::vector<int> &&buffer)
+{
+	size_t bytes = buffer.capacity() * sizeof(int);
+	if (bytes == 0 || SCRATCH_POOL.buffers.size() >= SCRATCH_BUFFERS || SCRATCH_POOL.bytes + bytes > SCRATCH_BYTES)
+	{
+		// freed with the vector
+		return;
+	}
+	SCRATCH_POOL.buffers.push_back(std::move(buffer));
+	SCRATCH_POOL.bytes += bytes;
+}
+
+void recycle(MatchSet &&set)
+{
+	if (ExplicitSet *list = std::get_if<ExplicitSet>(&set.set))
+	{
+		recycle(std::move(list->elems));
+	}
+}
@@ -0,0 +1,558 @@
+#include "corpus.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+// the server answers one request per line with JSON lines: a line per
+// match followed by a status line, or just the status line
+//
+//   <query>                          the first max_matches matches
+//   range <offset> <limit> <query>   the matches offset..offset + limit
+//   count <query>                    {"count":n,"timeout":b}
+//   explain <query>                  {"plan":"..."}
+//   prepare <name> <query>           {"prepared":"name","parameters":n}
+//   execute <name> ["value" ...]     the first max_matches matches of a
+//                                    prepared query, walked with its plan
+//   quit                             closes the connection
+//
+// a match line is {"sentence":s,"pos":p,"len":n,"text":"..."}, the status
+// line after the matches {"end":true,"matches":n,"more":b,"timeout":b}.
+// matches are looked for until the request timeout, a count that timed out
+// is of the matches found until then. errors are reported as
+// {"error":"..."}
+
+// the longest request line accepted
+const size_t MAX_REQUEST_SIZE = 1 << 16;
+// queries a connection can prepare at most
+const size_t MAX_PREPARED = 256;
+// buffered output is sent once it grows beyond this
+const size_t SEND_BUFFER_SIZE = 1 << 16;
+
+std::string json_string(std::string_view text)
+{
+	std::string quoted = "\"";
+	for (char c : text)
+	{
+		switch (c)
+		{
+		case '"':
+			quoted += "\\\"";
+			break;
+		case '\\':
+			quoted += "\\\\";
+			break;
+		case '\n':
+			quoted += "\\n";
+			break;
+		case '\t':
+			quoted += "\\t";
+			break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20)
+			{
+				char escaped[8];
+				std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				quoted += escaped;
+			}
+			else
+			{
+				quoted += c;
+			}
+		}
+	}
+	return quoted + "\"";
+}
+
+// a client connection with the requests received and the response being
+// written, sent in chunks. it is either waited on by the poll loop, queued
+// for a worker or being answered by one, never two of them at a time, so
+// its requests are answered in order
+struct Connection
+{
+	int fd;
+	std::string input; // received, not answered yet
+	std::string buffer;
+	bool failed = false;
+	bool closed = false; // the client quit
+	std::map<std::string, PreparedQuery> prepared; // by name
+
+	explicit Connection(int fd) : fd(fd) {}
+	Connection(const Connection &) = delete;
+	Connection &operator=(const Connection &) = delete;
+	~Connection() { close(fd); }
+
+	void write_line(const std::string &line)
+	{
+		buffer += line;
+		buffer += '\n';
+		if (buffer.size() >= SEND_BUFFER_SIZE)
+		{
+			flush();
+		}
+	}
+
+	void flush()
+	{
+		size_t sent = 0;
+		while (!failed && sent < buffer.size())
+		{
+			// no SIGPIPE when the client is gone
+			ssize_t n = send(fd, buffer.data() + sent, buffer.size() - sent, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (n <= 0)
+			{
+				failed = true;
+				break;
+			}
+			sent += n;
+		}
+		buffer.clear();
+	}
+
+	// takes the next complete request line out of the input, skipping
+	// empty ones. false if there is none
+	bool next_request(std::string &line)
+	{
+		size_t end;
+		while ((end = input.find('\n')) != std::string::npos)
+		{
+			line = input.substr(0, end);
+			input.erase(0, end + 1);
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+			if (!line.empty())
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool has_request() const { return input.find('\n') != std::string::npos; }
+};
+
+std::string match_line(const Corpus &corpus, const Match &match)
+{
+	int start = corpus.sentences[match.sentence] + match.pos;
+	std::string text;
+	for (int i = 0; i < match.len; i++)
+	{
+		if (i > 0)
+		{
+			text += ' ';
+		}
+		text += corpus.word_vocab[corpus.word_column[start + i]];
+	}
+	return "{\"sentence\":" + std::to_string(match.sentence) + ",\"pos\":" + std::to_string(match.pos) +
+		   ",\"len\":" + std::to_string(match.len) + ",\"text\":" + json_string(text) + "}";
+}
+
+// the line ending the matches of a request
+std::string status_line(size_t sent, bool more, bool timeout)
+{
+	return "{\"end\":true,\"matches\":" + std::to_string(sent) + ",\"more\":" + (more ? "true" : "false") +
+		   ",\"timeout\":" + (timeout ? "true" : "false") + "}";
+}
+
+// streams the matches offset..offset + limit of a cursor as it finds
+// them, until its deadline passes
+void stream_matches(const Corpus &corpus, MatchCursor &cursor, size_t offset, size_t limit, Connection &connection)
+{
+	// stops early at the last match as well as at the deadline
+	cursor.skip(offset);
+	size_t sent = 0;
+	Match match;
+	while (!connection.failed && sent < limit && cursor.next(match))
+	{
+		connection.write_line(match_line(corpus, match));
+		sent++;
+	}
+	bool more = sent == limit && cursor.advance();
+	connection.write_line(status_line(sent, more, cursor.timed_out()));
+}
+
+// answers one request line, false once the connection should be closed
+bool handle_request(const Corpus &corpus, const ServerOptions &options, const std::string &line, Connection &connection)
+{
+	if (line == "quit")
+	{
+		return false;
+	}
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeout_ms);
+	try
+	{
+		if (line.starts_with("count "))
+		{
+			Query query = parse_query(line.substr(6), corpus);
+			bool timeout;
+			size_t count = count_matches(corpus, query, deadline, timeout);
+			connection.write_line("{\"count\":" + std::to_string(count) + ",\"timeout\":" + (timeout ? "true" : "false") + "}");
+		}
+		else if (line.starts_with("explain "))
+		{
+			Query query = parse_query(line.substr(8), corpus);
+			connection.write_line("{\"plan\":" + json_string(describe_plan(plan_query(corpus, query))) + "}");
+		}
+		else if (line.starts_with("prepare "))
+		{
+			size_t space = line.find(' ', 8);
+			if (space == std::string::npos || space == 8)
+			{
+				throw std::runtime_error("expected prepare <name> <query>");
+			}
+			std::string name = line.substr(8, space - 8);
+			if (connection.prepared.size() >= MAX_PREPARED && !connection.prepared.contains(name))
+			{
+				throw std::runtime_error("too many prepared queries");
+			}
+			PreparedQuery prepared = prepare_query(corpus, line.substr(space + 1));
+			size_t parameters = prepared.parameters.size();
+			connection.prepared[name] = std::move(prepared);
+			connection.write_line("{\"prepared\":" + json_string(name) + ",\"parameters\":" + std::to_string(parameters) + "}");
+		}
+		else if (line.starts_with("execute "))
+		{
+			size_t space = std::min(line.find(' ', 8), line.size());
+			auto found = connection.prepared.find(line.substr(8, space - 8));
+			if (found == connection.prepared.end())
+			{
+				throw std::runtime_error("no prepared query " + line.substr(8, space - 8));
+			}
+			const PreparedQuery &prepared = found->second;
+			Query query = bind_query(corpus, prepared, parse_values(std::string_view(line).substr(space)));
+			// a query without parameters runs with the plan made when it
+			// was prepared
+			QueryPlan bound_plan;
+			const QueryPlan *plan = &prepared.plan;
+			if (!prepared.parameters.empty())
+			{
+				bound_plan = plan_bound(corpus, prepared, query);
+				plan = &bound_plan;
+			}
+			MatchCursor cursor(corpus, query, *plan);
+			cursor.set_deadline(deadline);
+			stream_matches(corpus, cursor, 0, options.max_matches, connection);
+		}
+		else if (line.starts_with("range "))
+		{
+			size_t offset, limit;
+			int consumed = 0;
+			if (std::sscanf(line.c_str() + 6, "%zu %zu %n", &offset, &limit, &consumed) < 2 || consumed == 0)
+			{
+				throw std::runtime_error("expected range <offset> <limit> <query>");
+			}
+			Query query = parse_query(line.substr(6 + consumed), corpus);
+			MatchCursor cursor(corpus, query);
+			cursor.set_deadline(deadline);
+			stream_matches(corpus, cursor, offset, std::min(limit, options.max_matches), connection);
+		}
+		else
+		{
+			Query query = parse_query(line, corpus);
+			MatchCursor cursor(corpus, query);
+			cursor.set_deadline(deadline);
+			stream_matches(corpus, cursor, 0, options.max_matches, connection);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		connection.write_line("{\"error\":" + json_string(e.what()) + "}");
+	}
+	connection.flush();
+	return !connection.failed;
+}
+
+// a unix socket for an address with a '/', else a port on localhost
+int listen_socket(const std::string &address)
+{
+	int fd;
+	if (address.find('/') != std::string::npos)
+	{
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(addr.sun_path))
+		{
+			throw std::runtime_error("Error: socket path too long: " + address);
+		}
+		std::strcpy(addr.sun_path, address.c_str());
+		unlink(address.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+		{
+			throw std::runtime_error("Error: cannot bind " + address + ": " + std::strerror(errno));
+		}
+	}
+	else
+	{
+		uint16_t port = 0;
+		auto [end, error] = std::from_chars(address.data(), address.data() + address.size(), port);
+		if (error != std::errc() || end != address.data() + address.size())
+		{
+			throw std::runtime_error("Error: expected a socket path or a port: " + address);
+		}
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(port);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+		{
+			throw std::runtime_error("Error: cannot bind port " + address + ": " + std::strerror(errno));
+		}
+	}
+	if (listen(fd, 64) < 0)
+	{
+		throw std::runtime_error(std::string("Error: cannot listen: ") + std::strerror(errno));
+	}
+	return fd;
+}
+
+// a poll loop reading the requests of every connection and a fixed pool of
+// workers answering them. a connection with a complete request line is
+// queued for the workers, which answer one line at a time, so clients
+// waiting between requests take no worker
+class Server
+{
+public:
+	Server(const Corpus &corpus, const ServerOptions &options) : corpus(corpus), options(options)
+	{
+		listener = listen_socket(options.address);
+		fcntl(listener, F_SETFL, O_NONBLOCK);
+		if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) < 0)
+		{
+			close(listener);
+			throw std::runtime_error(std::string("Error: cannot create a pipe: ") + std::strerror(errno));
+		}
+		for (size_t i = 0; i < std::max<size_t>(options.threads, 1); i++)
+		{
+			workers.emplace_back([this]
+								 { work(); });
+		}
+	}
+
+	// the workers finish the request they are answering and stop, before
+	// the corpus they read can go away
+	~Server()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready.notify_all();
+		for (std::thread &worker : workers)
+		{
+			worker.join();
+		}
+		close(listener);
+		close(wake[0]);
+		close(wake[1]);
+	}
+
+	void run()
+	{
+		std::cerr << "Serving queries on " << options.address << " with " << workers.size() << " worker(s)" << std::endl;
+		char chunk[4096];
+		std::vector<pollfd> fds;
+		while (true)
+		{
+			fds.assign({{listener, POLLIN, 0}, {wake[0], POLLIN, 0}});
+			for (const std::unique_ptr<Connection> &connection : idle)
+			{
+				fds.push_back({connection->fd, POLLIN, 0});
+			}
+			if (poll(fds.data(), fds.size(), -1) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				throw std::runtime_error(std::string("Error: poll failed: ") + std::strerror(errno));
+			}
+
+			// connections read in this round, queued or dropped, leave idle
+			std::vector<std::unique_ptr<Connection>> waiting;
+			for (size_t i = 0; i < idle.size(); i++)
+			{
+				std::unique_ptr<Connection> &connection = idle[i];
+				if (fds[i + 2].revents == 0)
+				{
+					waiting.push_back(std::move(connection));
+					continue;
+				}
+				ssize_t n = recv(connection->fd, chunk, sizeof(chunk), 0);
+				if (n < 0 && (errno == EINTR || errno == EAGAIN))
+				{
+					waiting.push_back(std::move(connection));
+				}
+				else if (n <= 0)
+				{
+					// hung up, closed with the connection
+				}
+				else
+				{
+					connection->input.append(chunk, n);
+					if (connection->has_request())
+					{
+						queue(std::move(connection));
+					}
+					else if (connection->input.size() > MAX_REQUEST_SIZE)
+					{
+						connection->write_line("{\"error\":\"request too long\"}");
+						connection->flush();
+					}
+					else
+					{
+						waiting.push_back(std::move(connection));
+					}
+				}
+			}
+			idle = std::move(waiting);
+
+			if (fds[1].revents != 0)
+			{
+				// connections the workers are done with
+				char drain[64];
+				while (read(wake[0], drain, sizeof(drain)) > 0)
+				{
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				for (std::unique_ptr<Connection> &connection : answered)
+				{
+					idle.push_back(std::move(connection));
+				}
+				answered.clear();
+			}
+			if (fds[0].revents != 0)
+			{
+				accept_connections();
+			}
+		}
+	}
+
+private:
+	void accept_connections()
+	{
+		while (true)
+		{
+			int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				if (errno == EINTR || errno == ECONNABORTED)
+				{
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					return;
+				}
+				if (errno == EMFILE || errno == ENFILE)
+				{
+					// taken once a connection closes, without spinning on
+					// the listener meanwhile
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					return;
+				}
+				throw std::runtime_error(std::string("Error: accept failed: ") + std::strerror(errno));
+			}
+			// a client that stops reading its response gives the worker
+			// back after the request timeout
+			timeval timeout{options.timeout_ms / 1000, options.timeout_ms % 1000 * 1000};
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			idle.push_back(std::make_unique<Connection>(fd));
+		}
+	}
+
+	void queue(std::unique_ptr<Connection> connection)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(std::move(connection));
+		}
+		ready.notify_one();
+	}
+
+	void work()
+	{
+		while (true)
+		{
+			std::unique_ptr<Connection> connection;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [&]
+						   { return stopping || !requests.empty(); });
+				if (stopping)
+				{
+					return;
+				}
+				connection = std::move(requests.front());
+				requests.pop_front();
+			}
+			std::string line;
+			if (connection->next_request(line))
+			{
+				connection->closed = !handle_request(corpus, options, line, *connection);
+			}
+			if (connection->closed || connection->failed)
+			{
+				// closed here
+				continue;
+			}
+			if (connection->has_request())
+			{
+				// behind the requests of the other connections
+				queue(std::move(connection));
+				continue;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				answered.push_back(std::move(connection));
+			}
+			char signal = 0;
+			ssize_t ignored = write(wake[1], &signal, 1);
+			(void)ignored;
+		}
+	}
+
+	const Corpus &corpus;
+	const ServerOptions &options;
+	int listener;
+	int wake[2]; // written by the workers to wake the poll loop
+	std::vector<std::unique_ptr<Connection>> idle; // polled for requests
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<std::unique_ptr<Connection>> requests; // with a complete request line
+	std::vector<std::unique_ptr<Connection>> answered; // to be polled again
+	bool stopping = false;
+	std::vector<std::thread> workers;
+};
+
+void serve(const Corpus &corpus, const ServerOptions &options)
+{
+	std::signal(SIGPIPE, SIG_IGN);
+	Server server(corpus, options);
+	server.run();
+}
@@ -0,0 +1,333 @@
+#include "corpus.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+// a query is split into shards of whole sentences that are run side by
+// side. every shard works on the slices of the posting lists and bitmaps
+// that fall into it, found by binary search, and produces its own matches,
+// which are concatenated in shard order
+
+// the tasks of one call to run_tasks
+struct TaskBatch
+{
+	const std::function<void(size_t)> *task;
+	std::atomic<size_t> left;
+	std::mutex mutex;
+	std::condition_variable done;
+	std::exception_ptr error;
+};
+
+struct Task
+{
+	TaskBatch *batch;
+	size_t index;
+};
+
+struct TaskQueue
+{
+	std::mutex mutex;
+	std::deque<Task> tasks;
+};
+
+// worker threads with a task queue each. the tasks of a batch are dealt
+// out to the queues, a worker takes tasks from the front of its own queue
+// and, once it is empty, steals from the back of the others
+class WorkerPool
+{
+public:
+	explicit WorkerPool(size_t threads) : queues(std::max<size_t>(threads, 1))
+	{
+		for (size_t i = 0; i < threads; i++)
+		{
+			workers.emplace_back([this, i]
+								 { work(i); });
+		}
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread &worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	void run(size_t count, const std::function<void(size_t)> &task)
+	{
+		TaskBatch batch;
+		batch.task = &task;
+		batch.left = count;
+		size_t first = next_queue.fetch_add(1);
+		for (size_t q = 0; q < queues.size(); q++)
+		{
+			std::lock_guard<std::mutex> lock(queues[q].mutex);
+			for (size_t i = (q + queues.size() - first % queues.size()) % queues.size(); i < count; i += queues.size())
+			{
+				queues[q].tasks.push_back(Task{&batch, i});
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex);
+			pending += count;
+		}
+		wake.notify_all();
+
+		// the calling thread helps until the batch is done, tasks of other
+		// batches included
+		Task next;
+		while (batch.left > 0 && take(first % queues.size(), next))
+		{
+			execute(next);
+		}
+		std::unique_lock<std::mutex> lock(batch.mutex);
+		batch.done.wait(lock, [&]
+						{ return batch.left == 0; });
+		if (batch.error)
+		{
+			std::rethrow_exception(batch.error);
+		}
+	}
+
+private:
+	void work(size_t home)
+	{
+		Task next;
+		while (true)
+		{
+			if (take(home, next))
+			{
+				execute(next);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(wake_mutex);
+			wake.wait(lock, [&]
+					  { return pending > 0 || stopping; });
+			if (stopping)
+			{
+				return;
+			}
+		}
+	}
+
+	// the next task of the home queue, else one stolen from another queue
+	bool take(size_t home, Task &task)
+	{
+		for (size_t k = 0; k < queues.size(); k++)
+		{
+			TaskQueue &queue = queues[(home + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty())
+			{
+				continue;
+			}
+			if (k == 0)
+			{
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+			}
+			else
+			{
+				task = queue.tasks.back();
+				queue.tasks.pop_back();
+			}
+			std::lock_guard<std::mutex> wake_lock(wake_mutex);
+			pending--;
+			return true;
+		}
+		return false;
+	}
+
+	void execute(const Task &task)
+	{
+		TaskBatch &batch = *task.batch;
+		try
+		{
+			(*batch.task)(task.index);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(batch.mutex);
+			if (!batch.error)
+			{
+				batch.error = std::current_exception();
+			}
+		}
+		// the last task wakes the thread waiting for the batch
+		std::lock_guard<std::mutex> lock(batch.mutex);
+		if (--batch.left == 0)
+		{
+			batch.done.notify_all();
+		}
+	}
+
+	std::vector<TaskQueue> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next_queue{0};
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	size_t pending = 0; // tasks in the queues
+	bool stopping = false;
+};
+
+size_t worker_threads()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void run_tasks(size_t count, const std::function<void(size_t)> &task)
+{
+	if (count <= 1 || worker_threads() == 1)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			task(i);
+		}
+		return;
+	}
+	// the caller is one of the threads
+	static WorkerPool pool(worker_threads() - 1);
+	pool.run(count, task);
+}
+
+std::vector<int> shard_bounds(const Corpus &corpus)
+{
+	int size = static_cast<int>(corpus.size());
+	// a few shards per thread, so a thread that is done early takes over
+	// part of the work of the others. on a single thread the shards would
+	// only add the cost of concatenating their matches
+	size_t threads = worker_threads();
+	size_t count = threads == 1 ? 1 : std::min(threads * SHARDS_PER_THREAD, corpus.size() / MIN_SHARD_TOKENS);
+	std::vector<int> bounds{0};
+	const Array<int> &sentences = corpus.sentences;
+	for (size_t i = 1; i < count; i++)
+	{
+		int target = static_cast<int>(corpus.size() * i / count);
+		const int *start = std::lower_bound(sentences.begin(), sentences.end(), target);
+		if (start != sentences.end() && *start > bounds.back() && *start < size)
+		{
+			bounds.push_back(*start);
+		}
+	}
+	bounds.push_back(size);
+	return bounds;
+}
+
+MatchSet slice_set(const MatchSet &set, int first, int last)
+{
+	MatchSet slice;
+	slice.complement = set.complement;
+	slice.set = std::visit([&](const auto &s) -> decltype(slice.set)
+						   {
+		using T = std::decay_t<decltype(s)>;
+		if constexpr (std::is_same_v<T, DenseSet>)
+		{
+			return DenseSet{std::max(s.first, first), std::max(std::max(s.first, first), std::min(s.last, last))};
+		}
+		else if constexpr (std::is_same_v<T, IndexSet>)
+		{
+			size_t from = list_bound(s.elems, s.shift, first);
+			size_t to = list_bound(s.elems, s.shift, last);
+			return IndexSet{s.elems.subspan(from, to - from), s.shift};
+		}
+		else if constexpr (std::is_same_v<T, ExplicitSet>)
+		{
+			auto from = std::lower_bound(s.elems.begin(), s.elems.end(), first);
+			auto to = std::lower_bound(from, s.elems.end(), last);
+			return ExplicitSet{std::vector<int>(from, to)};
+		}
+		else if constexpr (std::is_same_v<T, CompressedSet>)
+		{
+			// the blocks whose skip table range overlaps the shard, the
+			// size is an estimate for ordering the sets
+			const CompressedPostings &postings = *s.postings;
+			const int *block_last = postings.block_last.data();
+			const int *block_first = postings.block_first.data();
+			uint32_t from = std::lower_bound(block_last + s.first_block, block_last + s.last_block, static_cast<int64_t>(first) - s.shift, [](int pos, int64_t value)
+											 { return pos < value; }) -
+							block_last;
+			uint32_t to = std::lower_bound(block_first + from, block_first + s.last_block, static_cast<int64_t>(last) - s.shift, [](int pos, int64_t value)
+										   { return pos < value; }) -
+						  block_first;
+			size_t size = std::min(s.size, static_cast<size_t>(to - from) * POSTING_BLOCK_SIZE);
+			return CompressedSet{s.postings, from, to, size, s.shift};
+		}
+		else
+		{
+			// whole words, a view of the set's words, which outlive the
+			// shards. the bits beyond the shard are dropped with the
+			// matches
+			int64_t from = std::clamp<int64_t>((static_cast<int64_t>(first) - s.shift) / 64, 0, s.words.size());
+			int64_t to = std::clamp<int64_t>(bitmap_words(std::max<int64_t>(static_cast<int64_t>(last) - s.shift, 0)), from, s.words.size());
+			std::span<const uint64_t> words = s.words.span().subspan(from, to - from);
+			size_t size = 0;
+			for (uint64_t word : words)
+			{
+				size += std::popcount(word);
+			}
+			return BitmapSet{Array<uint64_t>(words, nullptr), s.shift + static_cast<int>(64 * from), size};
+		} }, set.set);
+	return slice;
+}
+
+std::vector<Match> match_sharded(const Corpus &corpus, const Query &query, const QueryPlan &plan)
+{
+	const ScanProgram &program = plan.program;
+	// a query estimated to take less than MIN_SHARDED_COST is not worth
+	// waking the workers for
+	double cost = plan.engine == Engine::scan ? plan.scan_cost : plan.index_cost;
+	std::vector<int> bounds = shard_bounds(corpus);
+	if (cost < MIN_SHARDED_COST || bounds.size() == 2)
+	{
+		if (plan.engine == Engine::scan)
+		{
+			return run_scan(corpus, program);
+		}
+		MatchSet result = match_set(corpus, query, plan);
+		std::vector<Match> matches = set_matches(corpus, result, query.size());
+		recycle(std::move(result));
+		return matches;
+	}
+	size_t shards = bounds.size() - 1;
+
+	std::vector<std::vector<Match>> results(shards);
+	run_tasks(shards, [&](size_t s)
+			  {
+		int first = bounds[s];
+		int last = bounds[s + 1];
+		if (plan.engine == Engine::scan)
+		{
+			results[s] = run_scan(corpus, program, first, last);
+			return;
+		}
+		QueryPlan shard_plan = plan;
+		for (MatchSet &set : shard_plan.sets)
+		{
+			set = slice_set(set, first, last);
+		}
+		MatchSet result = match_set(corpus, query, shard_plan);
+		results[s] = set_matches(corpus, result, query.size(), first, last);
+		recycle(std::move(result)); });
+
+	size_t total = 0;
+	for (const std::vector<Match> &result : results)
+	{
+		total += result.size();
+	}
+	std::vector<Match> matches;
+	matches.reserve(total);
+	for (const std::vector<Match> &result : results)
+	{
+		matches.insert(matches.end(), result.begin(), result.end());
+	}
+	return matches;
+}
@@ -0,0 +1,544 @@
+#include "corpus.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// snapshot layout (native byte order):
+//   header: magic, version, byte order mark, number of sections written
+//   sections: element count and element size followed by the elements,
+//   every section starts on a SNAPSHOT_ALIGNMENT boundary so the mapped
+//   arrays can be used in place. the element size of a column section
+//   tells which width the column was packed with. the binary indexes are
+//   stored as a section with their attribute names followed by the three
+//   arrays of every binary index. the compressed postings of an index are empty
+//   sections unless it was built with compression, its bitmaps follow them
+const char SNAPSHOT_MAGIC[8] = {'C', 'Q', 'S', 'N', 'A', 'P', '\0', '\0'};
+const uint32_t SNAPSHOT_VERSION = 9;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const size_t SNAPSHOT_ALIGNMENT = 64;
+
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t sections;
+};
+
+struct SectionHeader
+{
+	uint64_t count;
+	uint64_t element_size;
+};
+
+// every array (or column) stored in the snapshot, in file order
+template <typename C, typename F>
+void snapshot_sections(C &corpus, F &&section)
+{
+	section(corpus.word_column);
+	section(corpus.c5_column);
+	section(corpus.lemma_column);
+	section(corpus.pos_column);
+	section(corpus.sentences);
+	for (auto *vocab : {&corpus.word_vocab, &corpus.c5_vocab, &corpus.lemma_vocab, &corpus.pos_vocab})
+	{
+		section(vocab->strings.chars);
+		section(vocab->strings.offsets);
+		section(vocab->slots);
+	}
+	for (auto *index : {&corpus.word_index, &corpus.c5_index, &corpus.lemma_index, &corpus.pos_index})
+	{
+		section(index->positions);
+		section(index->offsets);
+		section(index->compressed.value_blocks);
+		section(index->compressed.block_first);
+		section(index->compressed.block_last);
+		section(index->compressed.block_bits);
+		section(index->compressed.block_data);
+		section(index->compressed.data);
+		section(index->bitmap_slots);
+		section(index->bitmaps);
+	}
+	section(corpus.binary_indices);
+	section(corpus.sentence_room);
+}
+
+// the attribute pairs of the binary indexes as "first second" lines
+Array<char> binary_index_names(const std::vector<BinaryIndex> &binary_indices)
+{
+	std::string names;
+	for (const BinaryIndex &index : binary_indices)
+	{
+		names += attribute_name(index.first);
+		names += ' ';
+		names += attribute_name(index.second);
+		names += '\n';
+	}
+	return std::vector<char>(names.begin(), names.end());
+}
+
+size_t align_up(size_t offset)
+{
+	return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+bool is_snapshot(const std::string &filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	char magic[sizeof(SNAPSHOT_MAGIC)];
+	if (!file.read(magic, sizeof(magic)))
+	{
+		return false;
+	}
+	return std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
+
+void save_snapshot(const Corpus &corpus, const std::string &filename)
+{
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Error: could not create snapshot " + filename);
+	}
+
+	// the number of sections is filled in once they are written
+	SnapshotHeader header;
+	std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	header.sections = 0;
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+	size_t offset = sizeof(header);
+	const char padding[SNAPSHOT_ALIGNMENT] = {};
+	auto write_array = [&](const auto &array)
+	{
+		using T = typename std::decay_t<decltype(array)>::value_type;
+		SectionHeader section{array.size(), sizeof(T)};
+		file.write(reinterpret_cast<const char *>(&section), sizeof(section));
+		offset += sizeof(section);
+
+		// pad so the elements start on an aligned offset
+		size_t start = align_up(offset);
+		file.write(padding, start - offset);
+		file.write(reinterpret_cast<const char *>(array.data()), array.size() * sizeof(T));
+		offset = start + array.size() * sizeof(T);
+		header.sections++;
+	};
+	snapshot_sections(corpus, [&](const auto &section)
+					  {
+		if constexpr (std::is_same_v<std::decay_t<decltype(section)>, Column>)
+		{
+			std::visit(write_array, section.values);
+		}
+		else if constexpr (std::is_same_v<std::decay_t<decltype(section)>, std::vector<BinaryIndex>>)
+		{
+			write_array(binary_index_names(section));
+			for (const BinaryIndex &index : section)
+			{
+				write_array(index.positions);
+				write_array(index.offsets);
+				write_array(index.seconds);
+			}
+		}
+		else
+		{
+			write_array(section);
+		} });
+	file.seekp(0);
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+	if (!file)
+	{
+		throw std::runtime_error("Error: could not write snapshot " + filename);
+	}
+}
+
+// the checks below make sure that a snapshot whose sections fit the file
+// is also safe to query: every offset, id and position read from it is
+// within the arrays it is used on. each takes one pass over its arrays
+
+// offsets into an array of size elements, rising from 0 to size
+bool valid_offsets(const Array<uint32_t> &offsets, size_t size)
+{
+	if (offsets.empty())
+	{
+		return size == 0;
+	}
+	if (offsets[0] != 0 || offsets[offsets.size() - 1] != size)
+	{
+		return false;
+	}
+	for (size_t i = 1; i < offsets.size(); i++)
+	{
+		if (offsets[i] < offsets[i - 1])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// loops without an early exit, so they vectorise
+template <typename T>
+bool all_below(const Array<T> &values, size_t limit)
+{
+	T largest = 0;
+	for (T value : values.span())
+	{
+		largest = std::max(largest, value);
+	}
+	return values.empty() || static_cast<size_t>(largest) < limit;
+}
+
+bool all_within(const Array<int> &positions, size_t size)
+{
+	int smallest = 0;
+	int largest = 0;
+	for (int pos : positions.span())
+	{
+		smallest = std::min(smallest, pos);
+		largest = std::max(largest, pos);
+	}
+	return positions.empty() || (smallest >= 0 && static_cast<size_t>(largest) < size);
+}
+
+bool valid_vocabulary(const Vocabulary &vocab)
+{
+	// the hash table has a power of two size and an empty slot, so every
+	// probe ends
+	const Array<uint32_t> &slots = vocab.slots;
+	if (!valid_offsets(vocab.strings.offsets, vocab.strings.chars.size()) || (!slots.empty() && !std::has_single_bit(slots.size())))
+	{
+		return false;
+	}
+	bool empty_slot = slots.empty();
+	for (uint32_t id : slots)
+	{
+		empty_slot = empty_slot || id == NO_ID;
+		if (id != NO_ID && id >= vocab.size())
+		{
+			return false;
+		}
+	}
+	return empty_slot;
+}
+
+// every posting list holds rising positions of the corpus
+bool valid_lists(const Array<int> &positions, const Array<uint32_t> &offsets, size_t size)
+{
+	if (!all_within(positions, size))
+	{
+		return false;
+	}
+	const int *list = positions.data();
+	bool rising = true;
+	for (size_t value = 0; value + 1 < offsets.size(); value++)
+	{
+		for (uint32_t i = offsets[value] + 1; i < offsets[value + 1]; i++)
+		{
+			rising &= list[i] > list[i - 1];
+		}
+	}
+	return rising;
+}
+
+// the blocks of every value decode to its list: as many rising positions
+// of the corpus as the offsets give it, each block within its skip table
+// entry and of the length its bit width calls for
+bool valid_postings(const CompressedPostings &postings, const Array<uint32_t> &offsets, size_t size)
+{
+	size_t blocks = postings.block_bits.size();
+	if (postings.value_blocks.size() != offsets.size() || !valid_offsets(postings.value_blocks, blocks) ||
+		postings.block_first.size() != blocks || postings.block_last.size() != blocks ||
+		postings.block_data.size() != blocks + 1 || !valid_offsets(postings.block_data, postings.data.size()))
+	{
+		return false;
+	}
+	int decoded[POSTING_BLOCK_SIZE];
+	for (size_t value = 0; value + 1 < offsets.size(); value++)
+	{
+		size_t count = 0;
+		int64_t previous = -1;
+		for (uint32_t block = postings.value_blocks[value]; block < postings.value_blocks[value + 1]; block++)
+		{
+			uint32_t bits = postings.block_bits[block];
+			size_t words = postings.block_data[block + 1] - postings.block_data[block];
+			bool raw = bits == RAW_BLOCK && words > 0 && words <= POSTING_BLOCK_SIZE;
+			if (!raw && (bits > 32 || words != POSTING_BLOCK_SIZE * bits / 32))
+			{
+				return false;
+			}
+			size_t decoded_count = postings.decode(block, decoded);
+			if (decoded[0] != postings.block_first[block] || decoded[decoded_count - 1] != postings.block_last[block])
+			{
+				return false;
+			}
+			for (size_t i = 0; i < decoded_count; i++)
+			{
+				if (decoded[i] <= previous || static_cast<size_t>(decoded[i]) >= size)
+				{
+					return false;
+				}
+				previous = decoded[i];
+			}
+			count += decoded_count;
+		}
+		if (count != offsets[value + 1] - offsets[value])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool valid_index(const Index &index, size_t values, size_t size)
+{
+	if (index.offsets.size() != values + 1 || index.offsets[values] != size)
+	{
+		return false;
+	}
+	if (index.is_compressed())
+	{
+		if (!index.positions.empty() || !valid_postings(index.compressed, index.offsets, size))
+		{
+			return false;
+		}
+	}
+	else if (index.positions.size() != size || !valid_offsets(index.offsets, size) || !valid_lists(index.positions, index.offsets, size))
+	{
+		return false;
+	}
+
+	// the bits past the corpus end are clear, a bitmap walk never finds a
+	// position outside of it
+	size_t words = bitmap_words(size);
+	if (index.bitmaps.empty())
+	{
+		return index.bitmap_slots.empty();
+	}
+	if (words == 0 || index.bitmaps.size() % words != 0 || index.bitmap_slots.size() != values)
+	{
+		return false;
+	}
+	size_t bitmaps = index.bitmaps.size() / words;
+	for (uint32_t slot : index.bitmap_slots)
+	{
+		if (slot != NO_ID && slot >= bitmaps)
+		{
+			return false;
+		}
+	}
+	uint64_t tail = size % 64 == 0 ? 0 : ~uint64_t(0) << (size % 64);
+	for (size_t bitmap = 0; bitmap < bitmaps; bitmap++)
+	{
+		if (index.bitmaps[(bitmap + 1) * words - 1] & tail)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool valid_attribute(const Corpus &corpus, Attribute attribute)
+{
+	const Column &column = *find_column(corpus, attribute);
+	const Vocabulary &vocab = *find_vocabulary(corpus, attribute);
+	bool values_valid = std::visit([&](const auto &values)
+								   { return all_below(values, vocab.size()); }, column.values);
+	return column.size() == corpus.size() && values_valid && valid_vocabulary(vocab) && valid_index(*find_index(corpus, attribute), vocab.size(), corpus.size());
+}
+
+bool valid_binary_index(const Corpus &corpus, const BinaryIndex &index)
+{
+	size_t first_values = find_vocabulary(corpus, index.first)->size();
+	size_t second_values = find_vocabulary(corpus, index.second)->size();
+	// a pair starts before the last token
+	size_t starts = std::max<size_t>(corpus.size(), 1) - 1;
+	return index.offsets.size() == first_values + 1 && valid_offsets(index.offsets, index.positions.size()) &&
+		   index.seconds.size() == index.positions.size() && all_below(index.seconds, second_values) &&
+		   all_within(index.positions, starts);
+}
+
+bool consistent(const Corpus &corpus)
+{
+	size_t size = corpus.size();
+	if (size > static_cast<size_t>(std::numeric_limits<int>::max()))
+	{
+		return false;
+	}
+	// a sentence starts at 0, the others follow in order
+	const Array<int> &sentences = corpus.sentences;
+	if (sentences.empty() || sentences[0] != 0)
+	{
+		return false;
+	}
+	for (size_t i = 1; i < sentences.size(); i++)
+	{
+		if (sentences[i] < sentences[i - 1] || static_cast<size_t>(sentences[i]) > size)
+		{
+			return false;
+		}
+	}
+	if (!corpus.sentence_room.empty() && corpus.sentence_room.size() != size + ROOM_PADDING)
+	{
+		return false;
+	}
+	// the attributes and binary indexes are checked side by side
+	const Attribute attributes[] = {Attribute::word, Attribute::c5, Attribute::lemma, Attribute::pos};
+	const size_t unary = std::size(attributes);
+	std::vector<char> valid(unary + corpus.binary_indices.size());
+	run_tasks(valid.size(), [&](size_t task)
+			  { valid[task] = task < unary ? valid_attribute(corpus, attributes[task]) : valid_binary_index(corpus, corpus.binary_indices[task - unary]); });
+	return std::all_of(valid.begin(), valid.end(), [](char passed)
+					   { return passed != 0; });
+}
+
+// owns the mapping, shared by every array viewing into it
+struct MappedFile
+{
+	void *data = MAP_FAILED;
+	size_t size = 0;
+
+	~MappedFile()
+	{
+		if (data != MAP_FAILED)
+		{
+			munmap(data, size);
+		}
+	}
+};
+
+Corpus open_snapshot(const std::string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Error: could not open snapshot " + filename);
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SnapshotHeader))
+	{
+		close(fd);
+		throw std::runtime_error("Error: " + filename + " is not a corpus snapshot");
+	}
+
+	auto mapping = std::make_shared<MappedFile>();
+	mapping->size = info.st_size;
+	mapping->data = mmap(nullptr, mapping->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping->data == MAP_FAILED)
+	{
+		throw std::runtime_error("Error: could not map snapshot " + filename);
+	}
+
+	const char *base = static_cast<const char *>(mapping->data);
+	SnapshotHeader header;
+	std::memcpy(&header, base, sizeof(header));
+	if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+	{
+		throw std::runtime_error("Error: " + filename + " is not a corpus snapshot");
+	}
+	if (header.version != SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER)
+	{
+		throw std::runtime_error("Error: snapshot " + filename + " was written by an incompatible version, rebuild it");
+	}
+
+	Corpus corpus;
+	uint64_t sections = 0; // read so far
+	size_t offset = sizeof(header);
+	// reads the next section header and checks that the elements fit the file
+	auto next_section = [&]()
+	{
+		SectionHeader section;
+		if (offset + sizeof(section) > mapping->size)
+		{
+			throw std::runtime_error("Error: snapshot " + filename + " is truncated");
+		}
+		std::memcpy(&section, base + offset, sizeof(section));
+		offset = align_up(offset + sizeof(section));
+		sections++;
+		// compared without multiplying, a crafted count could overflow
+		if (section.element_size == 0 || offset > mapping->size || section.count > (mapping->size - offset) / section.element_size)
+		{
+			throw std::runtime_error("Error: snapshot " + filename + " is corrupt");
+		}
+		return section;
+	};
+	auto map_array = [&]<typename T>(const SectionHeader &section, Array<T> &array)
+	{
+		if (section.element_size != sizeof(T))
+		{
+			throw std::runtime_error("Error: snapshot " + filename + " is corrupt");
+		}
+		const T *elems = reinterpret_cast<const T *>(base + offset);
+		array = Array<T>(std::span<const T>(elems, section.count), mapping);
+		offset += section.count * sizeof(T);
+	};
+	snapshot_sections(corpus, [&](auto &target)
+					  {
+		SectionHeader section = next_section();
+		if constexpr (std::is_same_v<std::decay_t<decltype(target)>, std::vector<BinaryIndex>>)
+		{
+			Array<char> names;
+			map_array(section, names);
+			std::istringstream lines(std::string(names.begin(), names.end()));
+			std::string first, second;
+			while (lines >> first >> second)
+			{
+				std::optional<Attribute> first_attribute = find_attribute(first);
+				std::optional<Attribute> second_attribute = find_attribute(second);
+				if (!first_attribute || !second_attribute)
+				{
+					throw std::runtime_error("Error: snapshot " + filename + " is corrupt");
+				}
+				BinaryIndex index;
+				index.first = *first_attribute;
+				index.second = *second_attribute;
+				target.push_back(index);
+			}
+			for (BinaryIndex &binary_index : target)
+			{
+				map_array(next_section(), binary_index.positions);
+				map_array(next_section(), binary_index.offsets);
+				map_array(next_section(), binary_index.seconds);
+			}
+		}
+		else if constexpr (std::is_same_v<std::decay_t<decltype(target)>, Column>)
+		{
+			// pick the column width the snapshot was written with
+			if (section.element_size == sizeof(uint8_t))
+			{
+				target.values.template emplace<Array<uint8_t>>();
+			}
+			else if (section.element_size == sizeof(uint16_t))
+			{
+				target.values.template emplace<Array<uint16_t>>();
+			}
+			else
+			{
+				target.values.template emplace<Array<uint32_t>>();
+			}
+			std::visit([&](auto &array)
+					   { map_array(section, array); }, target.values);
+		}
+		else
+		{
+			map_array(section, target);
+		} });
+
+	// the header counts every section, with the names and the three
+	// arrays of each binary index
+	if (sections != header.sections || !consistent(corpus))
+	{
+		throw std::runtime_error("Error: snapshot " + filename + " is corrupt");
+	}
+	return corpus;
+}